@@ -1,6 +1,136 @@
 #include <bits/stdc++.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 
+// Exact currency amount in ten-thousandths of a unit. Sums, differences and
+// multiples are integer and exact; every operation that rounds does so half
+// away from zero: fromDouble (to the nearest unit), parse (past four
+// decimals), operator/ and mulDiv, and format (to the requested decimals).
+// Results that do not fit in int64 throw rather than wrap.
+class Money {
+    int64_t m_units = 0;
+
+    constexpr explicit Money(int64_t units) : m_units(units) {}
+
+    [[noreturn]] static void overflow() { throw runtime_error("Money overflow."); }
+
+    // n / d rounded half away from zero; d > 0.
+    static int64_t roundDiv(__int128 n, __int128 d) {
+        __int128 q = n / d, r = n % d;
+        if (2 * (r < 0 ? -r : r) >= d) q += n < 0 ? -1 : 1;
+        if (q > numeric_limits<int64_t>::max() || q < numeric_limits<int64_t>::min()) overflow();
+        return static_cast<int64_t>(q);
+    }
+
+public:
+    static constexpr int64_t kScale = 10000;
+    static constexpr int kDecimals = 4;
+
+    constexpr Money() = default;
+    static constexpr Money fromUnits(int64_t units) { return Money(units); }
+
+    static Money fromDouble(double v) {
+        double u = round(v * static_cast<double>(kScale));
+        if (!(fabs(u) < 0x1p63)) throw runtime_error("Money out of range.");
+        return Money(static_cast<int64_t>(u));
+    }
+
+    // Parses all of s as [-+]digits[.digits]; false if it is anything else.
+    static bool parse(string_view s, Money& out) {
+        size_t i = 0;
+        bool neg = false;
+        if (i < s.size() && (s[i] == '-' || s[i] == '+')) neg = s[i++] == '-';
+        uint64_t units = 0;
+        size_t digits = 0;
+        auto push = [&](int d) {
+            return !__builtin_mul_overflow(units, 10, &units) && !__builtin_add_overflow(units, d, &units);
+        };
+        for (; i < s.size() && isdigit(static_cast<unsigned char>(s[i])); ++i, ++digits)
+            if (!push(s[i] - '0')) return false;
+        int frac = 0;
+        bool up = false;
+        if (i < s.size() && s[i] == '.') {
+            for (++i; i < s.size() && isdigit(static_cast<unsigned char>(s[i])); ++i, ++digits) {
+                if (frac < kDecimals) { if (!push(s[i] - '0')) return false; ++frac; }
+                else if (frac++ == kDecimals) up = s[i] >= '5';
+            }
+        }
+        if (digits == 0 || i != s.size()) return false;
+        for (; frac < kDecimals; ++frac) if (!push(0)) return false;
+        if (up && __builtin_add_overflow(units, 1, &units)) return false;
+        if (units > uint64_t(numeric_limits<int64_t>::max())) return false;
+        out = Money(neg ? -static_cast<int64_t>(units) : static_cast<int64_t>(units));
+        return true;
+    }
+
+    constexpr int64_t units() const { return m_units; }
+    double toDouble() const { return static_cast<double>(m_units) / static_cast<double>(kScale); }
+
+    Money operator+(Money o) const {
+        int64_t r;
+        if (__builtin_add_overflow(m_units, o.m_units, &r)) overflow();
+        return Money(r);
+    }
+    Money operator-(Money o) const {
+        int64_t r;
+        if (__builtin_sub_overflow(m_units, o.m_units, &r)) overflow();
+        return Money(r);
+    }
+    Money operator-() const { return Money() - *this; }
+    Money& operator+=(Money o) { return *this = *this + o; }
+    Money& operator-=(Money o) { return *this = *this - o; }
+
+    Money operator*(int64_t n) const {
+        int64_t r;
+        if (__builtin_mul_overflow(m_units, n, &r)) overflow();
+        return Money(r);
+    }
+    Money operator/(int64_t d) const {
+        if (d == 0) throw runtime_error("Money division by zero.");
+        return Money(roundDiv(d < 0 ? -__int128(m_units) : __int128(m_units), d < 0 ? -__int128(d) : __int128(d)));
+    }
+    // this * num / den with an exact intermediate; den > 0.
+    Money mulDiv(int64_t num, int64_t den) const {
+        return Money(roundDiv(__int128(m_units) * num, den));
+    }
+
+    bool operator==(Money o) const { return m_units == o.m_units; }
+    bool operator!=(Money o) const { return m_units != o.m_units; }
+    bool operator<(Money o) const { return m_units < o.m_units; }
+    bool operator<=(Money o) const { return m_units <= o.m_units; }
+    bool operator>(Money o) const { return m_units > o.m_units; }
+    bool operator>=(Money o) const { return m_units >= o.m_units; }
+
+    // Writes the amount with `decimals` (0..4) places into [first, last);
+    // returns one past the last char, or first if it does not fit.
+    char* format(char* first, char* last, int decimals = 2) const {
+        uint64_t step = 1;
+        for (int i = decimals; i < kDecimals; ++i) step *= 10;
+        uint64_t mag = m_units < 0 ? 0 - static_cast<uint64_t>(m_units) : static_cast<uint64_t>(m_units);
+        mag = (mag + step / 2) / step;
+        uint64_t scale = static_cast<uint64_t>(kScale) / step;
+        char* p = first;
+        if (m_units < 0 && mag != 0) { if (p == last) return first; *p++ = '-'; }
+        auto r = to_chars(p, last, mag / scale);
+        if (r.ec != errc()) return first;
+        p = r.ptr;
+        if (decimals > 0) {
+            if (last - p < decimals + 1) return first;
+            *p++ = '.';
+            uint64_t f = mag % scale;
+            for (int i = decimals - 1; i >= 0; --i) { p[i] = static_cast<char>('0' + f % 10); f /= 10; }
+            p += decimals;
+        }
+        return p;
+    }
+};
+
 namespace util {
     inline string trim(const string& s) {
         size_t a = s.find_first_not_of(" \t\r\n");
@@ -9,254 +139,3971 @@ namespace util {
         return s.substr(a, b - a + 1);
     }
 
-    inline vector<string> splitCSV(const string& line) {
-        vector<string> out;
-        string cur; bool inQuote = false;
-        for (char c : line) {
-            if (c == '"') { inQuote = !inQuote; }
-            else if (c == ',' && !inQuote) {
-                out.push_back(trim(cur)); cur.clear();
-            } else cur.push_back(c);
+    // Bit i set where p[i] is ',', '"' or '\n', for 64 bytes at p.
+    inline uint64_t csvMaskScalar(const char* p) {
+        uint64_t m = 0;
+        for (int i = 0; i < 64; ++i)
+            if (p[i] == ',' || p[i] == '"' || p[i] == '\n') m |= uint64_t(1) << i;
+        return m;
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    inline uint64_t csvMaskSse2(const char* p) {
+        const __m128i comma = _mm_set1_epi8(','), quote = _mm_set1_epi8('"'), nl = _mm_set1_epi8('\n');
+        uint64_t m = 0;
+        for (int i = 0; i < 64; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, quote)),
+                                       _mm_cmpeq_epi8(v, nl));
+            m |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(hit))) << i;
+        }
+        return m;
+    }
+
+    __attribute__((target("avx2"))) inline uint64_t csvMaskAvx2(const char* p) {
+        const __m256i comma = _mm256_set1_epi8(','), quote = _mm256_set1_epi8('"'), nl = _mm256_set1_epi8('\n');
+        uint64_t m = 0;
+        for (int i = 0; i < 64; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, comma), _mm256_cmpeq_epi8(v, quote)),
+                                          _mm256_cmpeq_epi8(v, nl));
+            m |= uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(hit))) << i;
+        }
+        return m;
+    }
+#endif
+
+    using CsvMask = uint64_t (*)(const char*);
+
+    inline CsvMask csvMask() {
+        static const CsvMask f = [] {
+#if defined(__x86_64__) && defined(__GNUC__)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) return static_cast<CsvMask>(csvMaskAvx2);
+            return static_cast<CsvMask>(csvMaskSse2);
+#endif
+            return static_cast<CsvMask>(csvMaskScalar);
+        }();
+        return f;
+    }
+
+    // RFC 4180 reader over a caller-owned buffer. Structural characters are
+    // found 64 bytes at a time with SIMD compares; fields come back as views
+    // into the buffer. Only quoted fields holding "" escapes are copied, into
+    // a scratch buffer reused across records. Unquoted fields are trimmed of
+    // blanks and '\r'; text after a closing quote is kept verbatim.
+    // Views stay valid until the next call to next().
+    class CsvReader {
+        struct Span { const char* p; size_t off, len; };  // p == nullptr: in m_scratch
+
+        const char* m_data;
+        size_t m_size;
+        size_t m_pos = 0;
+        size_t m_record = 0;
+        CsvMask m_mask = csvMask();
+        size_t m_blockPos = 0;   // m_bits describes [m_blockPos, m_blockPos + 64)
+        uint64_t m_bits = 0;
+        bool m_haveBlock = false;
+        vector<Span> m_spans;
+        vector<string_view> m_fields;
+        string m_scratch;
+
+        static bool blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+        void loadBlock(size_t pos) {
+            m_blockPos = pos;
+            m_haveBlock = true;
+            if (pos + 64 <= m_size) { m_bits = m_mask(m_data + pos); return; }
+            char tail[64] = {};
+            memcpy(tail, m_data + pos, m_size - pos);
+            m_bits = csvMaskScalar(tail) & ((uint64_t(1) << (m_size - pos)) - 1);
+        }
+
+        // Offset of the first ',', '"' or '\n' at or after pos, or m_size.
+        size_t structural(size_t pos) {
+            while (pos < m_size) {
+                if (!m_haveBlock || pos < m_blockPos || pos >= m_blockPos + 64) loadBlock(pos);
+                uint64_t bits = m_bits & (~uint64_t(0) << (pos - m_blockPos));
+                if (bits) return m_blockPos + static_cast<size_t>(__builtin_ctzll(bits));
+                pos = m_blockPos + 64;
+            }
+            return m_size;
+        }
+
+        void addView(const char* b, const char* e) {
+            while (b < e && blank(*b)) ++b;
+            while (e > b && blank(e[-1])) --e;
+            m_spans.push_back(Span{b, 0, static_cast<size_t>(e - b)});
+        }
+
+        // Parses the quoted field opening at m_data[q]; returns the offset of
+        // the ',' or '\n' that ends it, or m_size.
+        size_t quoted(size_t q) {
+            size_t seg = q + 1, p = q + 1;
+            bool copied = false;
+            size_t off = m_scratch.size();
+            size_t close;
+            for (;;) {
+                close = structural(p);
+                if (close == m_size) break;              // unterminated: runs to end of input
+                if (m_data[close] != '"') { p = close + 1; continue; }
+                if (close + 1 < m_size && m_data[close + 1] == '"') {
+                    m_scratch.append(m_data + seg, close + 1 - seg);
+                    copied = true;
+                    seg = p = close + 2;
+                    continue;
+                }
+                break;
+            }
+            size_t end = close < m_size ? structural(close + 1) : m_size;
+            while (end < m_size && m_data[end] == '"') end = structural(end + 1);
+            // Stray text between the closing quote and the delimiter.
+            const char* tb = m_data + min(close + 1, m_size);
+            const char* te = m_data + end;
+            while (tb < te && blank(*tb)) ++tb;
+            while (te > tb && blank(te[-1])) --te;
+            if (!copied && tb == te) {
+                m_spans.push_back(Span{m_data + seg, 0, close - seg});
+                return end;
+            }
+            m_scratch.append(m_data + seg, close - seg);
+            m_scratch.append(tb, static_cast<size_t>(te - tb));
+            m_spans.push_back(Span{nullptr, off, m_scratch.size() - off});
+            return end;
+        }
+
+    public:
+        CsvReader(const char* data, size_t size) : m_data(data), m_size(size) {}
+        explicit CsvReader(string_view text) : CsvReader(text.data(), text.size()) {}
+
+        // Parses the next record; false once the input is exhausted.
+        bool next() {
+            if (m_pos >= m_size) return false;
+            m_spans.clear(); m_fields.clear(); m_scratch.clear();
+            size_t p = m_pos;
+            for (;;) {
+                size_t f = p;
+                while (f < m_size && (m_data[f] == ' ' || m_data[f] == '\t')) ++f;
+                size_t d;
+                if (f < m_size && m_data[f] == '"') {
+                    d = quoted(f);
+                } else {
+                    d = structural(f);
+                    while (d < m_size && m_data[d] == '"') d = structural(d + 1);  // literal quote
+                    addView(m_data + f, m_data + d);
+                }
+                p = d + 1;
+                if (d >= m_size || m_data[d] == '\n') break;
+            }
+            m_pos = p;
+            ++m_record;
+            for (auto& s : m_spans)
+                m_fields.emplace_back(s.p ? s.p : m_scratch.data() + s.off, s.len);
+            return true;
+        }
+
+        const vector<string_view>& fields() const { return m_fields; }
+        size_t size() const { return m_fields.size(); }
+        string_view operator[](size_t i) const { return m_fields[i]; }
+        size_t record() const { return m_record; }  // 1-based index of the current record
+        size_t offset() const { return m_pos; }     // bytes consumed so far
+    };
+
+    inline vector<string> splitCSV(const string& line) {
+        CsvReader r(line);
+        if (!r.next()) return {string()};
+        return vector<string>(r.fields().begin(), r.fields().end());
+    }
+
+    // FNV-1a over 64-bit words, then the tail bytes.
+    inline uint64_t checksum(const char* p, size_t n) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            uint64_t w; memcpy(&w, p + i, 8);
+            h = (h ^ w) * 0x100000001b3ULL;
+        }
+        for (; i < n; ++i) h = (h ^ static_cast<unsigned char>(p[i])) * 0x100000001b3ULL;
+        return h;
+    }
+
+    // Writes all of [p, p+n) to fd, retrying short writes.
+    inline bool writeAll(int fd, const char* p, size_t n) {
+        while (n > 0) {
+            ssize_t w = ::write(fd, p, n);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return false;
+            p += w; n -= static_cast<size_t>(w);
+        }
+        return true;
+    }
+
+    // fsyncs the directory holding path, so a rename into it is durable.
+    inline bool syncDir(const string& path) {
+        size_t slash = path.rfind('/');
+        string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0) return false;
+        bool ok = ::fsync(fd) == 0;
+        return ::close(fd) == 0 && ok;
+    }
+
+    // Longest fixed-notation double with two decimals ("-" + 309 digits + ".00").
+    constexpr size_t kMoneyChars = 320;
+
+    // Writes v with exactly two decimals (same text as iostream fixed/
+    // setprecision(2)) into [first, last); returns one past the last char.
+    // No allocation; a kMoneyChars buffer always suffices.
+    inline char* formatMoney(char* first, char* last, double v) {
+        auto r = to_chars(first, last, v, chars_format::fixed, 2);
+        return r.ec == errc() ? r.ptr : first;
+    }
+
+    // Stack-held formatted amount that streams like a string (honours setw).
+    class MoneyText {
+        char m_buf[kMoneyChars];
+        size_t m_len;
+    public:
+        explicit MoneyText(double v)
+            : m_len(static_cast<size_t>(formatMoney(m_buf, m_buf + kMoneyChars, v) - m_buf)) {}
+        explicit MoneyText(Money v)
+            : m_len(static_cast<size_t>(v.format(m_buf, m_buf + kMoneyChars) - m_buf)) {}
+        string_view view() const { return string_view(m_buf, m_len); }
+        friend ostream& operator<<(ostream& os, const MoneyText& m) { return os << m.view(); }
+    };
+
+    inline char* formatMoney(char* first, char* last, Money v) { return v.format(first, last); }
+
+    inline MoneyText money(double v) { return MoneyText(v); }
+    inline MoneyText money(Money v) { return MoneyText(v); }
+
+    inline string toMoney(double v) { return string(money(v).view()); }
+    inline string toMoney(Money v) { return string(money(v).view()); }
+}
+
+// Read-only private mapping of a whole file; empty if the file is missing.
+class MappedFile {
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+public:
+    MappedFile() = default;
+    explicit MappedFile(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) { m_data = static_cast<const char*>(p); m_size = static_cast<size_t>(st.st_size); }
+        }
+        ::close(fd);
+    }
+    ~MappedFile() { if (m_data) ::munmap(const_cast<char*>(m_data), m_size); }
+    MappedFile(MappedFile&& o) noexcept : m_data(o.m_data), m_size(o.m_size) { o.m_data = nullptr; o.m_size = 0; }
+    MappedFile& operator=(MappedFile&& o) noexcept {
+        if (this != &o) { this->~MappedFile(); new (this) MappedFile(std::move(o)); }
+        return *this;
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    explicit operator bool() const { return m_data != nullptr; }
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+};
+
+namespace model {
+    constexpr double kDrift = 0.0005;  // tiny positive drift
+
+    // One step of the random-walk price model shared by Stock and Market.
+    inline double step(double price, double drift, double shock) {
+        double np = price * (1.0 + drift + shock);
+        // Clamp to a reasonable range to avoid going to zero or exploding
+        return max(1.0, min(np, price * 1.25));
+    }
+}
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3").
+namespace philox {
+    using Counter = array<uint32_t, 4>;
+    using Key = array<uint32_t, 2>;
+
+    inline Counter block(Counter c, Key k) {
+        for (int r = 0; r < 10; ++r) {
+            uint64_t p0 = uint64_t{0xD2511F53} * c[0];
+            uint64_t p1 = uint64_t{0xCD9E8D57} * c[2];
+            c = {static_cast<uint32_t>(p1 >> 32) ^ c[1] ^ k[0], static_cast<uint32_t>(p1),
+                 static_cast<uint32_t>(p0 >> 32) ^ c[3] ^ k[1], static_cast<uint32_t>(p0)};
+            k[0] += 0x9E3779B9; k[1] += 0xBB67AE85;
+        }
+        return c;
+    }
+}
+
+// Batch price kernels. The same generic code is instantiated for AVX-512,
+// AVX2 and plain scalar lanes; kernels() picks the widest the CPU supports.
+namespace simd {
+    constexpr size_t kBlock = 2048;  // normals per batch, stays in L1
+
+    template <int W> struct Lanes {
+        typedef double D __attribute__((vector_size(8 * W)));
+        typedef int64_t I __attribute__((vector_size(8 * W)));
+    };
+    template <> struct Lanes<1> { using D = double; using I = int64_t; };
+
+    // Helpers pass lanes by reference so they never touch the vector call ABI.
+    template <class To, class From>
+    __attribute__((always_inline)) inline void bitCast(To& out, const From& v) {
+        static_assert(sizeof(To) == sizeof(From), "size mismatch");
+        memcpy(&out, &v, sizeof out);
+    }
+
+    template <class V>
+    __attribute__((always_inline)) inline void load(V& v, const double* p) { memcpy(&v, p, sizeof v); }
+
+    template <class V>
+    __attribute__((always_inline)) inline void store(double* p, const V& v) { memcpy(p, &v, sizeof v); }
+
+    __attribute__((always_inline)) inline void sqrt(double& x) { x = std::sqrt(x); }
+#if defined(__x86_64__) && defined(__GNUC__)
+    // Only reachable from the flattened target entry points below, which is
+    // where they get inlined.
+    __attribute__((target("avx2"))) inline void sqrt(Lanes<4>::D& x) {
+        x = reinterpret_cast<Lanes<4>::D>(_mm256_sqrt_pd(reinterpret_cast<__m256d>(x)));
+    }
+    __attribute__((target("avx512f"))) inline void sqrt(Lanes<8>::D& x) {
+        x = reinterpret_cast<Lanes<8>::D>(_mm512_maskz_sqrt_pd(0xff, reinterpret_cast<__m512d>(x)));
+    }
+#endif
+
+    // Natural log for positive normal inputs, ~1e-15 relative error.
+    template <int W>
+    __attribute__((always_inline)) inline void log(typename Lanes<W>::D& x) {
+        using D = typename Lanes<W>::D; using I = typename Lanes<W>::I;
+        I b; bitCast(b, x);
+        D m, e;
+        bitCast(m, I((b & 0x000fffffffffffffLL) | 0x3ff0000000000000LL));
+        bitCast(e, I((b >> 52) | 0x4330000000000000LL));
+        e -= 4503599627370496.0 + 1023.0;
+        auto big = m > 1.4142135623730951;
+        m = big ? m * 0.5 : m;
+        e = big ? e + 1.0 : e;
+        D f = m - 1.0;
+        D s = f / (2.0 + f);
+        D s2 = s * s;
+        D p = 1.0 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 * (1.0 / 9
+                  + s2 * (1.0 / 11 + s2 * (1.0 / 13 + s2 * (1.0 / 15)))))));
+        x = e * 0.6931471805599453 + 2.0 * s * p;
+    }
+
+    // sin/cos of 2*pi*u, reduced to an octant around the nearest quarter turn.
+    template <int W>
+    __attribute__((always_inline)) inline void sinCos2Pi(const typename Lanes<W>::D& u,
+                                                         typename Lanes<W>::D& sn,
+                                                         typename Lanes<W>::D& cs) {
+        using D = typename Lanes<W>::D; using I = typename Lanes<W>::I;
+        const double kRound = 6755399441055744.0;  // 1.5 * 2^52
+        D t = u * 4.0;
+        D r = t + kRound;
+        I q; bitCast(q, r);
+        q &= 3;
+        D x = (t - (r - kRound)) * 1.5707963267948966;
+        D x2 = x * x;
+        D s = x * (1.0 + x2 * (-1.0 / 6 + x2 * (1.0 / 120 + x2 * (-1.0 / 5040 + x2 * (1.0 / 362880
+                  + x2 * (-1.0 / 39916800 + x2 * (1.0 / 6227020800 + x2 * (-1.0 / 1307674368000))))))));
+        D c = 1.0 + x2 * (-1.0 / 2 + x2 * (1.0 / 24 + x2 * (-1.0 / 720 + x2 * (1.0 / 40320
+                  + x2 * (-1.0 / 3628800 + x2 * (1.0 / 479001600 + x2 * (-1.0 / 87178291200
+                  + x2 * (1.0 / 20922789888000))))))));
+        auto swap = (q & 1) != 0;
+        D c2 = swap ? s : c;
+        D s2 = swap ? c : s;
+        cs = ((q + 1) & 2) != 0 ? -c2 : c2;
+        sn = (q & 2) != 0 ? -s2 : s2;
+    }
+
+    // Box-Muller in place: buf[0,h) and buf[h,2h) hold uniforms in (0,1) on
+    // entry and standard normals on exit.
+    template <int W>
+    __attribute__((always_inline)) inline void boxMullerImpl(double* buf, size_t h) {
+        using D = typename Lanes<W>::D;
+        size_t i = 0;
+        for (; i + W <= h; i += W) {
+            D r, u, sn, cs;
+            load(r, buf + i);
+            log<W>(r);
+            r *= -2.0;
+            sqrt(r);
+            load(u, buf + h + i);
+            sinCos2Pi<W>(u, sn, cs);
+            store(buf + i, D(r * cs));
+            store(buf + h + i, D(r * sn));
+        }
+        if constexpr (W > 1) {
+            for (; i < h; ++i) {
+                double r = buf[i], sn, cs;
+                log<1>(r);
+                r = std::sqrt(-2.0 * r);
+                sinCos2Pi<1>(buf[h + i], sn, cs);
+                buf[i] = r * cs; buf[h + i] = r * sn;
+            }
+        }
+    }
+
+    // px[i] = model::step(px[i], drift[i], vol[i] * z[i]) over whole arrays.
+    template <int W>
+    __attribute__((always_inline)) inline void gbmImpl(double* px, const double* drift, const double* vol,
+                                                       const double* z, size_t n) {
+        using D = typename Lanes<W>::D;
+        size_t i = 0;
+        for (; i + W <= n; i += W) {
+            D p, d, v, e;
+            load(p, px + i); load(d, drift + i); load(v, vol + i); load(e, z + i);
+            D np = p * (1.0 + d + v * e);
+            D hi = p * 1.25;
+            np = np < hi ? np : hi;
+            np = np > 1.0 ? np : 1.0;
+            store(px + i, np);
+        }
+        for (; i < n; ++i) px[i] = model::step(px[i], drift[i], vol[i] * z[i]);
+    }
+
+    inline void boxMullerScalar(double* buf, size_t h) { boxMullerImpl<1>(buf, h); }
+    inline void gbmScalar(double* px, const double* d, const double* v, const double* z, size_t n) {
+        gbmImpl<1>(px, d, v, z, n);
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    __attribute__((target("avx2"), flatten))
+    inline void boxMullerAvx2(double* buf, size_t h) { boxMullerImpl<4>(buf, h); }
+    __attribute__((target("avx2"), flatten))
+    inline void gbmAvx2(double* px, const double* d, const double* v, const double* z, size_t n) {
+        gbmImpl<4>(px, d, v, z, n);
+    }
+    __attribute__((target("avx512f"), flatten))
+    inline void boxMullerAvx512(double* buf, size_t h) { boxMullerImpl<8>(buf, h); }
+    __attribute__((target("avx512f"), flatten))
+    inline void gbmAvx512(double* px, const double* d, const double* v, const double* z, size_t n) {
+        gbmImpl<8>(px, d, v, z, n);
+    }
+#endif
+
+    struct Kernels {
+        const char* isa;
+        void (*boxMuller)(double* buf, size_t h);
+        void (*gbm)(double* px, const double* drift, const double* vol, const double* z, size_t n);
+    };
+
+    inline const Kernels& scalarKernels() {
+        static const Kernels k{"scalar", boxMullerScalar, gbmScalar};
+        return k;
+    }
+
+    inline const Kernels& kernels() {
+        static const Kernels k = [] {
+#if defined(__x86_64__) && defined(__GNUC__)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f")) return Kernels{"avx512", boxMullerAvx512, gbmAvx512};
+            if (__builtin_cpu_supports("avx2")) return Kernels{"avx2", boxMullerAvx2, gbmAvx2};
+#endif
+            return scalarKernels();
+        }();
+        return k;
+    }
+
+    // Fills buf[0,n) with standard normals drawn from rng; buf needs room for n + 1.
+    template <class Rng>
+    void normals(const Kernels& k, Rng& rng, double* buf, size_t n) {
+        size_t h = (n + 1) / 2;
+        for (size_t i = 0; i < 2 * h; ++i) buf[i] = (static_cast<double>(rng()) + 0.5) * 0x1p-32;
+        k.boxMuller(buf, h);
+    }
+
+    // One GBM step over n prices with normals drawn from rng, kBlock at a
+    // time; noise needs room for kBlock + 1. With src, the step reads the old
+    // prices from src instead of price, copying a block at a time while it is
+    // in cache.
+    template <class Rng>
+    void gbmStep(const Kernels& k, Rng& rng, double* price, const double* drift, const double* vol,
+                 size_t n, double* noise, const double* src = nullptr) {
+        for (size_t i = 0; i < n; i += kBlock) {
+            size_t len = min(kBlock, n - i);
+            if (src) copy_n(src + i, len, price + i);
+            normals(k, rng, noise, len);
+            k.gbm(price + i, drift + i, vol + i, noise, len);
+        }
+    }
+
+    // Counter-based normals: the value for security `id` at tick `tick` depends
+    // only on (seed, id, tick), never on how the universe is split into shards.
+    // Block b of kBlock ids draws Philox counter {tick, b, pair / 2}; pair j
+    // feeds ids b*kBlock + j (cos half) and b*kBlock + kBlock/2 + j (sin half).
+    inline void philoxNormals(const Kernels& k, uint64_t seed, uint64_t tick, uint64_t block,
+                              double* buf, size_t n) {
+        size_t h = min(n, kBlock / 2);
+        const array<uint32_t, 2> key{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)};
+        for (size_t j = 0; j < h; j += 2) {
+            auto w = philox::block({static_cast<uint32_t>(tick), static_cast<uint32_t>(tick >> 32),
+                                    static_cast<uint32_t>(block), static_cast<uint32_t>(j / 2)}, key);
+            buf[j] = (static_cast<double>(w[0]) + 0.5) * 0x1p-32;
+            buf[h + j] = (static_cast<double>(w[1]) + 0.5) * 0x1p-32;
+            if (j + 1 < h) {
+                buf[j + 1] = (static_cast<double>(w[2]) + 0.5) * 0x1p-32;
+                buf[h + j + 1] = (static_cast<double>(w[3]) + 0.5) * 0x1p-32;
+            }
+        }
+        k.boxMuller(buf, h);
+    }
+}
+
+// Fixed set of worker threads; run() fans task indices out to the workers
+// and the calling thread, and returns once all of them have finished.
+class ThreadPool {
+    vector<thread> m_workers;
+    mutex m_mutex;
+    condition_variable m_wake, m_done;
+    const function<void(size_t)>* m_job = nullptr;
+    size_t m_tasks = 0;
+    atomic<size_t> m_next{0};
+    size_t m_active = 0;
+    uint64_t m_generation = 0;
+    bool m_stop = false;
+
+    void drain(const function<void(size_t)>& job, size_t tasks) {
+        for (size_t i; (i = m_next.fetch_add(1)) < tasks;) job(i);
+    }
+
+    void workerLoop() {
+        uint64_t seen = 0;
+        unique_lock<mutex> lk(m_mutex);
+        while (true) {
+            m_wake.wait(lk, [&]{ return m_stop || m_generation != seen; });
+            if (m_stop) return;
+            seen = m_generation;
+            const auto* job = m_job;
+            size_t tasks = m_tasks;
+            lk.unlock();
+            drain(*job, tasks);
+            lk.lock();
+            if (--m_active == 0) m_done.notify_one();
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threads = thread::hardware_concurrency()) {
+        for (size_t i = 1; i < max<size_t>(threads, 1); ++i) m_workers.emplace_back([this]{ workerLoop(); });
+    }
+
+    ~ThreadPool() {
+        { lock_guard<mutex> lk(m_mutex); m_stop = true; }
+        m_wake.notify_all();
+        for (auto& t : m_workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return m_workers.size() + 1; }
+
+    void run(size_t tasks, const function<void(size_t)>& job) {
+        if (m_workers.empty() || tasks <= 1) {
+            for (size_t i = 0; i < tasks; ++i) job(i);
+            return;
+        }
+        {
+            lock_guard<mutex> lk(m_mutex);
+            m_job = &job; m_tasks = tasks; m_next = 0;
+            m_active = m_workers.size();
+            ++m_generation;
+        }
+        m_wake.notify_all();
+        drain(job, tasks);
+        unique_lock<mutex> lk(m_mutex);
+        m_done.wait(lk, [&]{ return m_active == 0; });
+    }
+};
+
+// Test-and-test-and-set lock for short critical sections on hot paths.
+class SpinLock {
+    atomic<bool> m_locked{false};
+public:
+    void lock() {
+        while (m_locked.exchange(true, memory_order_acquire))
+            while (m_locked.load(memory_order_relaxed)) this_thread::yield();
+    }
+    void unlock() { m_locked.store(false, memory_order_release); }
+};
+
+// Epoch-based reclamation for data handed to readers on other threads. A
+// reader holds a Guard, which pins the global epoch in its thread's slot; a
+// writer unpublishes an object, calls advance(), and may reuse the object
+// once oldestPinned() has reached the epoch advance() returned. Pinning is
+// wait-free once the thread owns a slot (claimed on its first Guard).
+namespace epoch {
+    constexpr size_t kMaxThreads = 256;
+    constexpr uint64_t kIdle = numeric_limits<uint64_t>::max();
+
+    struct alignas(64) Slot {
+        atomic<uint64_t> pinned{kIdle};
+        atomic<bool> owned{false};
+    };
+    inline Slot g_slots[kMaxThreads];
+    inline atomic<size_t> g_slotsUsed{0};  // high-water mark of claimed slots
+    inline atomic<uint64_t> g_epoch{1};
+
+    struct Local {
+        Slot* slot = nullptr;
+        unsigned depth = 0;  // nested Guards share the outermost pin
+        ~Local() { if (slot) slot->owned.store(false, memory_order_release); }
+    };
+
+    inline Local& local() {
+        thread_local Local t;
+        if (t.slot) return t;
+        for (size_t i = 0; i < kMaxThreads; ++i) {
+            bool expected = false;
+            if (g_slots[i].owned.load(memory_order_relaxed) || !g_slots[i].owned.compare_exchange_strong(expected, true))
+                continue;
+            for (size_t used = g_slotsUsed.load(); used <= i && !g_slotsUsed.compare_exchange_weak(used, i + 1);) {}
+            t.slot = &g_slots[i];
+            return t;
+        }
+        throw runtime_error("Too many reader threads.");
+    }
+
+    class Guard {
+        Local& m_local;
+    public:
+        Guard() : m_local(local()) {
+            if (m_local.depth++ == 0) m_local.slot->pinned.store(g_epoch.load());
+        }
+        ~Guard() {
+            if (--m_local.depth == 0) m_local.slot->pinned.store(kIdle, memory_order_release);
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    // Starts a new epoch and returns it.
+    inline uint64_t advance() { return g_epoch.fetch_add(1) + 1; }
+
+    // The earliest epoch a live Guard was taken in, or kIdle if none is.
+    inline uint64_t oldestPinned() {
+        uint64_t oldest = kIdle;
+        for (size_t i = 0, n = g_slotsUsed.load(); i < n; ++i) oldest = min(oldest, g_slots[i].pinned.load());
+        return oldest;
+    }
+}
+
+class Security {
+public:
+    virtual ~Security() = default;
+    virtual const string& symbol() const = 0;
+    virtual const string& name() const = 0;
+    virtual double price() const = 0;
+    virtual double volatility() const = 0;
+    virtual double drift() const = 0;
+    virtual void updatePrice(std::mt19937& rng) = 0; // polymorphic
+};
+
+class Stock : public Security {
+    string m_symbol;
+    string m_name;
+    double m_price;
+    double m_baseVol; 
+public:
+    Stock(string sym, string nm, double p, double vol)
+        : m_symbol(std::move(sym)), m_name(std::move(nm)), m_price(p), m_baseVol(vol) {}
+
+    const string& symbol() const override { return m_symbol; }
+    const string& name()   const override { return m_name; }
+    double price()  const override { return m_price; }
+    double volatility() const override { return m_baseVol; }
+    double drift()  const override { return model::kDrift; }
+
+    void updatePrice(std::mt19937& rng) override {
+        std::normal_distribution<double> noise(0.0, m_baseVol);
+        m_price = model::step(m_price, model::kDrift, noise(rng));
+    }
+};
+
+using SecId = uint32_t;
+
+// Bump allocator for strings that live as long as their owner: store()
+// copies the text in and returns a view of the copy. Memory comes from a
+// few geometrically growing blocks and is only returned all at once.
+class StringArena {
+    pmr::monotonic_buffer_resource m_mem;
+public:
+    string_view store(string_view s) {
+        if (s.empty()) return {};
+        char* p = static_cast<char*>(m_mem.allocate(s.size(), 1));
+        memcpy(p, s.data(), s.size());
+        return string_view(p, s.size());
+    }
+    pmr::memory_resource* resource() { return &m_mem; }
+};
+
+// Interns ticker strings to dense ids. This is the only place a symbol string
+// is hashed; everything past the I/O boundary carries the id. The text and
+// the index nodes all live in the table's arena.
+class SymbolTable {
+    StringArena m_arena;
+    pmr::unordered_map<string_view, SecId> m_index{m_arena.resource()};
+    vector<string_view> m_names;
+public:
+    static constexpr SecId npos = numeric_limits<SecId>::max();
+
+    SecId intern(string_view sym) {
+        auto it = m_index.find(sym);
+        if (it != m_index.end()) return it->second;
+        string_view key = m_arena.store(sym);
+        SecId id = static_cast<SecId>(m_names.size());
+        m_index.emplace(key, id);
+        m_names.push_back(key);
+        return id;
+    }
+
+    SecId find(string_view sym) const {
+        auto it = m_index.find(sym);
+        return it == m_index.end() ? npos : it->second;
+    }
+
+    void reserve(size_t n) { m_index.reserve(n); m_names.reserve(n); }
+    size_t size() const { return m_names.size(); }
+    string_view name(SecId id) const { return m_names[id]; }
+};
+
+// Receives the new price of each watched security after every Market::tick.
+// Listeners must not watch/unwatch from inside onPrice.
+class PriceListener {
+public:
+    virtual ~PriceListener() = default;
+    virtual void onPrice(SecId id, double price) = 0;
+};
+
+// The whole universe as of one tick: prices and cumulative traded volume,
+// both indexed by SecId.
+struct TickColumns {
+    const double* price;
+    const int64_t* volume;
+    size_t size;
+    uint64_t tick;
+};
+
+// Receives every column after each Market::tick step, on the ticking thread;
+// a tick of several steps notifies once per step. Sinks must not
+// subscribe/unsubscribe from inside onTick.
+class TickSink {
+public:
+    virtual ~TickSink() = default;
+    virtual void onTick(const TickColumns& cols) = 0;
+};
+
+// An extra column for Market::list; NaN values print as "-".
+struct ListColumn {
+    string title;
+    function<double(SecId)> value;
+};
+
+// Half-open range of SecIds.
+struct IdRange {
+    SecId begin, end;
+};
+
+// The columns a PriceSource moves, indexed by SecId. stockRuns lists the ids
+// that are plain Stocks, ascending; the rest are adapter instruments.
+struct PriceColumns {
+    double* price;
+    const double* drift;
+    const double* vol;
+    size_t size;
+    const IdRange* stockRuns;
+    size_t stockRunCount;
+};
+
+// Where Market::tick gets its next prices. advance() moves the columns one
+// step and returns false, changing nothing, once the source is exhausted.
+class PriceSource {
+public:
+    virtual ~PriceSource() = default;
+    virtual bool advance(const PriceColumns& cols) = 0;
+};
+
+// One copy of the price column. A frame is immutable once published, except
+// that Market::add appends past `size` in place.
+struct PriceFrame {
+    unique_ptr<double[]> price;
+    size_t capacity = 0;
+    atomic<size_t> size{0};
+    uint64_t tick = 0;      // Market::tickCount when published
+    uint64_t retired = 0;   // epoch it was unpublished at
+};
+
+// Every price as of one tick. The view pins the current epoch, so its frame
+// stays untouched until the view is destroyed; use it on one thread only.
+class PriceView {
+    epoch::Guard m_guard;
+    const PriceFrame* m_frame;
+    size_t m_size;
+public:
+    explicit PriceView(const atomic<PriceFrame*>& front)
+        : m_frame(front.load()), m_size(m_frame->size.load(memory_order_acquire)) {}
+
+    double operator[](SecId id) const { return m_frame->price[id]; }
+    const double* data() const { return m_frame->price.get(); }
+    size_t size() const { return m_size; }
+    uint64_t tick() const { return m_frame->tick; }
+};
+
+// The random GBM model over the Stock group; adapter instruments hold still
+// (Market::tick(rng) moves those through their own updatePrice).
+class ModelSource : public PriceSource {
+    mt19937& m_rng;
+    vector<double> m_noise;
+public:
+    explicit ModelSource(mt19937& rng) : m_rng(rng), m_noise(simd::kBlock + 1) {}
+
+    bool advance(const PriceColumns& c) override {
+        const simd::Kernels& k = simd::kernels();
+        for (size_t r = 0; r < c.stockRunCount; ++r) {
+            size_t b = c.stockRuns[r].begin, len = c.stockRuns[r].end - b;
+            simd::gbmStep(k, m_rng, c.price + b, c.drift + b, c.vol + b, len, m_noise.data());
+        }
+        return true;
+    }
+};
+
+// Dense lower-triangular factors, stored packed by rows: row i holds i + 1
+// entries starting at i * (i + 1) / 2, so any row prefix is contiguous.
+namespace linalg {
+    constexpr size_t kTile = 64;
+
+    inline size_t packedSize(size_t n) { return n * (n + 1) / 2; }
+    inline double* row(double* l, size_t i) { return l + i * (i + 1) / 2; }
+    inline const double* row(const double* l, size_t i) { return l + i * (i + 1) / 2; }
+
+    inline double dot(const double* a, const double* b, size_t n) {
+        double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        const size_t n4 = n & ~size_t{3};
+        for (size_t i = 0; i < n4; i += 4) {
+            s0 += a[i] * b[i]; s1 += a[i + 1] * b[i + 1];
+            s2 += a[i + 2] * b[i + 2]; s3 += a[i + 3] * b[i + 3];
+        }
+        for (size_t i = n4; i < n; ++i) s0 += a[i] * b[i];
+        return (s0 + s1) + (s2 + s3);
+    }
+
+    // In-place Cholesky factor of a packed symmetric matrix (its lower
+    // triangle). Blocked by kTile: each tile of L is first reduced by whole
+    // tiles of earlier columns, so its rows and theirs stay in cache, then
+    // finished column by column. Throws if the matrix is not positive definite.
+    inline void cholesky(double* a, size_t n) {
+        for (size_t ib = 0; ib < n; ib += kTile) {
+            const size_t ie = min(n, ib + kTile);
+            for (size_t jb = 0; jb <= ib; jb += kTile) {
+                const size_t je = min(ie, jb + kTile);
+                for (size_t pb = 0; pb < jb; pb += kTile)
+                    for (size_t i = ib; i < ie; ++i)
+                        for (size_t j = jb; j < je && j <= i; ++j)
+                            row(a, i)[j] -= dot(row(a, i) + pb, row(a, j) + pb, kTile);
+                for (size_t i = ib; i < ie; ++i) {
+                    double* li = row(a, i);
+                    for (size_t j = jb; j < je && j <= i; ++j) {
+                        double v = li[j] - dot(li + jb, row(a, j) + jb, j - jb);
+                        if (j < i) { li[j] = v / row(a, j)[j]; continue; }
+                        if (!(v > 0.0)) throw runtime_error("Correlation matrix is not positive definite.");
+                        li[j] = sqrt(v);
+                    }
+                }
+            }
+        }
+    }
+
+    // y = L z for eight right-hand sides at once: z and y are n x 8,
+    // row-major. The eight columns ride in registers, so each entry of L is
+    // loaded once for eight products; L then streams through row by row
+    // while z (64 bytes a row) stays in L2.
+    inline void lowerMultiply8(const double* l, size_t n, const double* z, double* y) {
+        using D = simd::Lanes<2>::D;
+        for (size_t i = 0; i < n; ++i) {
+            const double* li = row(l, i);
+            D a0 = {}, a1 = {}, a2 = {}, a3 = {}, z0, z1, z2, z3;
+            for (size_t j = 0; j <= i; ++j) {
+                const double* zj = z + j * 8;
+                simd::load(z0, zj); simd::load(z1, zj + 2); simd::load(z2, zj + 4); simd::load(z3, zj + 6);
+                a0 += li[j] * z0; a1 += li[j] * z1; a2 += li[j] * z2; a3 += li[j] * z3;
+            }
+            double* yi = y + i * 8;
+            simd::store(yi, a0); simd::store(yi + 2, a1); simd::store(yi + 4, a2); simd::store(yi + 6, a3);
+        }
+    }
+}
+
+// GBM over the Stock group with shocks correlated across securities. Every
+// security keeps its volatility from the Market; the model only supplies
+// correlations, so any covariance passed in is rescaled to unit diagonal.
+// Shocks are drawn kBatch ticks at a time, which lets the correlation
+// structure stream from memory once per batch instead of once per tick.
+class CorrelatedSource : public PriceSource {
+protected:
+    static constexpr size_t kBatch = 8;  // the width of linalg::lowerMultiply8
+
+    size_t m_n;
+    mt19937& m_rng;
+    vector<double> m_z;      // independent normals, row-major
+    vector<double> m_shock;  // n x kBatch correlated normals, row-major
+    vector<double> m_tick;   // one column of m_shock
+    size_t m_next = kBatch;
+
+    CorrelatedSource(size_t n, size_t normals, mt19937& rng)
+        : m_n(n), m_rng(rng), m_z(normals * kBatch + 1), m_shock(n * kBatch), m_tick(n) {}
+
+    // Turns m_z into m_shock.
+    virtual void correlate() = 0;
+
+public:
+    bool advance(const PriceColumns& c) override {
+        if (c.size != m_n) throw runtime_error("Correlation model does not match the market.");
+        const simd::Kernels& k = simd::kernels();
+        if (m_next == kBatch) {
+            simd::normals(k, m_rng, m_z.data(), m_z.size() - 1);
+            correlate();
+            m_next = 0;
+        }
+        for (size_t i = 0; i < m_n; ++i) m_tick[i] = m_shock[i * kBatch + m_next];
+        ++m_next;
+        for (size_t r = 0; r < c.stockRunCount; ++r) {
+            size_t b = c.stockRuns[r].begin, len = c.stockRuns[r].end - b;
+            k.gbm(c.price + b, c.drift + b, c.vol + b, m_tick.data() + b, len);
+        }
+        return true;
+    }
+};
+
+// Dense model: an n x n correlation or covariance matrix (row-major, by
+// SecId), Cholesky-factored once; each tick's shocks are L z. O(n^2) a tick.
+class CholeskySource : public CorrelatedSource {
+    vector<double> m_factor;  // packed lower triangle
+
+    void correlate() override { linalg::lowerMultiply8(m_factor.data(), m_n, m_z.data(), m_shock.data()); }
+
+public:
+    CholeskySource(mt19937& rng, const vector<double>& matrix, size_t n)
+        : CorrelatedSource(n, n, rng), m_factor(linalg::packedSize(n)) {
+        if (matrix.size() != n * n) throw runtime_error("Correlation matrix must be n x n.");
+        for (size_t i = 0; i < n; ++i)
+            if (!(matrix[i * n + i] > 0.0)) throw runtime_error("Correlation matrix is not positive definite.");
+        for (size_t i = 0; i < n; ++i)
+            for (size_t j = 0; j <= i; ++j)
+                linalg::row(m_factor.data(), i)[j] = matrix[i * n + j] / sqrt(matrix[i * n + i] * matrix[j * n + j]);
+        linalg::cholesky(m_factor.data(), n);
+    }
+};
+
+// Factor model for universes too large for a dense matrix: shock_i is
+// sum_k B_ik f_k + sqrt(d_i) e_i with k common factors f and specific noise
+// e, i.e. covariance B B^T + diag(d), rescaled to unit diagonal. O(n k) a tick.
+class FactorSource : public CorrelatedSource {
+    size_t m_k;
+    vector<double> m_loading;   // n x k, row-major, rescaled
+    vector<double> m_specific;  // sqrt(d_i), rescaled
+
+    // Same register blocking as linalg::lowerMultiply8: eight ticks a row.
+    void correlate() override {
+        using D = simd::Lanes<2>::D;
+        const double* f = m_z.data() + m_n * kBatch;  // k x kBatch factor draws
+        for (size_t i = 0; i < m_n; ++i) {
+            const double* e = m_z.data() + i * kBatch;
+            const double* b = m_loading.data() + i * m_k;
+            D a0, a1, a2, a3, f0, f1, f2, f3;
+            simd::load(a0, e); simd::load(a1, e + 2); simd::load(a2, e + 4); simd::load(a3, e + 6);
+            a0 *= m_specific[i]; a1 *= m_specific[i]; a2 *= m_specific[i]; a3 *= m_specific[i];
+            for (size_t q = 0; q < m_k; ++q) {
+                const double* fq = f + q * kBatch;
+                simd::load(f0, fq); simd::load(f1, fq + 2); simd::load(f2, fq + 4); simd::load(f3, fq + 6);
+                a0 += b[q] * f0; a1 += b[q] * f1; a2 += b[q] * f2; a3 += b[q] * f3;
+            }
+            double* y = m_shock.data() + i * kBatch;
+            simd::store(y, a0); simd::store(y + 2, a1); simd::store(y + 4, a2); simd::store(y + 6, a3);
+        }
+    }
+
+public:
+    // loading is n x k row-major; specific holds the n variances d_i.
+    FactorSource(mt19937& rng, vector<double> loading, const vector<double>& specific, size_t k)
+        : CorrelatedSource(specific.size(), specific.size() + k, rng), m_k(k),
+          m_loading(std::move(loading)), m_specific(specific.size()) {
+        if (m_loading.size() != m_n * k) throw runtime_error("Factor loadings must be n x k.");
+        for (size_t i = 0; i < m_n; ++i) {
+            const double* b = m_loading.data() + i * k;
+            double var = linalg::dot(b, b, k) + specific[i];
+            if (!(specific[i] >= 0.0) || !(var > 0.0)) throw runtime_error("Factor model variances must be positive.");
+            double s = 1.0 / sqrt(var);
+            for (size_t q = 0; q < k; ++q) m_loading[i * k + q] *= s;
+            m_specific[i] = sqrt(specific[i]) * s;
+        }
+    }
+};
+
+// Securities live in dense columns indexed by a stable SecId (insertion order);
+// the symbol table is only an index into them.
+//
+// Instruments are grouped by concrete type. Plain Stocks keep no object at
+// all: their ids form contiguous runs that the SIMD GBM kernel walks. Any
+// other Security subclass is kept as-is in the adapter group, ticked through
+// its own updatePrice, and its price mirrored into the price column, so every
+// reader still sees one dense column.
+//
+// Concurrency: one thread adds and ticks; any number of threads may call
+// price(), snapshot(), watch() and unwatch() meanwhile. Prices are double
+// buffered: a tick writes the next prices into a back frame, reading the old
+// ones from the front, and publishes it with one atomic pointer swap, so a
+// reader sees all of one tick or all of the next and never waits. Unpublished
+// frames are reused once no reader pinned before the swap is left (see
+// namespace epoch); a view held for a long time only makes ticks allocate.
+// prices() is raw access for the ticking thread only.
+class Market {
+    SymbolTable m_symbols;
+    StringArena m_text;        // backs m_name
+    vector<string_view> m_name;
+    atomic<PriceFrame*> m_front{nullptr};
+    vector<unique_ptr<PriceFrame>> m_frames;  // owns every frame
+    vector<PriceFrame*> m_retired;            // unpublished, epoch ascending
+    vector<PriceFrame*> m_spare;              // reclaimed, free for the next tick
+    vector<double> m_baseVol;
+    vector<double> m_drift;
+    vector<double> m_noise;  // tick scratch
+    vector<IdRange> m_stockRuns;  // Stock ids, ascending, adjacent runs merged
+    struct Adapter {
+        SecId id;
+        unique_ptr<Security> sec;
+    };
+    vector<Adapter> m_adapters;
+    vector<int32_t> m_adapterSlot;  // by SecId: index into m_adapters, or -1
+    vector<vector<PriceListener*>> m_listeners;  // by SecId
+    vector<SecId> m_watched;                     // ids with at least one listener
+    vector<uint32_t> m_watchSlot;                // position in m_watched
+    vector<TickSink*> m_sinks;
+    vector<int64_t> m_traded;  // cumulative quantity traded, by SecId
+    // Symbol order is kept as two sorted runs: m_sorted, plus m_recent for
+    // ids that arrived out of order. m_recent is folded into m_sorted once
+    // it outgrows sqrt(size), so adds stay cheap and a listing is one merge.
+    vector<SecId> m_sorted;
+    vector<SecId> m_recent;
+    uint64_t m_tick = 0;
+    mutex m_watchMutex;  // guards m_listeners / m_watched / m_watchSlot / m_sinks
+
+    PriceFrame* front() const { return m_front.load(memory_order_relaxed); }
+
+    void reclaim() {
+        if (m_retired.empty()) return;
+        uint64_t oldest = epoch::oldestPinned();
+        size_t k = 0;
+        while (k < m_retired.size() && m_retired[k]->retired <= oldest) ++k;
+        m_spare.insert(m_spare.end(), m_retired.begin(), m_retired.begin() + static_cast<ptrdiff_t>(k));
+        m_retired.erase(m_retired.begin(), m_retired.begin() + static_cast<ptrdiff_t>(k));
+    }
+
+    // An unpublished frame sized like the front one, with room for at least
+    // `capacity` prices; its contents are stale.
+    PriceFrame* spareFrame(size_t capacity = 0) {
+        reclaim();
+        if (m_spare.empty()) {
+            m_frames.push_back(make_unique<PriceFrame>());
+            m_spare.push_back(m_frames.back().get());
+        }
+        PriceFrame* f = m_spare.back();
+        m_spare.pop_back();
+        const PriceFrame* src = front();
+        capacity = max(capacity, src->capacity);
+        if (f->capacity < capacity) {
+            f->price.reset(new double[capacity]);
+            f->capacity = capacity;
+        }
+        f->size.store(src->size.load(memory_order_relaxed), memory_order_relaxed);
+        return f;
+    }
+
+    // A spare frame holding a copy of the front prices.
+    PriceFrame* backFrame(size_t capacity = 0) {
+        PriceFrame* f = spareFrame(capacity);
+        copy_n(prices(), size(), f->price.get());
+        return f;
+    }
+
+    // Whether a tick of `times` steps must run them one by one so that
+    // sinks see each step; the prices come out the same either way.
+    bool stepwise(int times) {
+        if (times <= 1) return false;
+        lock_guard<mutex> lk(m_watchMutex);
+        return !m_sinks.empty();
+    }
+
+    void publish(PriceFrame* f) {
+        f->tick = m_tick;
+        PriceFrame* old = m_front.exchange(f);
+        old->retired = epoch::advance();
+        m_retired.push_back(old);
+    }
+
+    bool symbolLess(SecId a, SecId b) const { return symbol(a) < symbol(b); }
+
+    void index(SecId id) {
+        auto less = [this](SecId a, SecId b) { return symbolLess(a, b); };
+        if (m_sorted.empty() || less(m_sorted.back(), id)) { m_sorted.push_back(id); return; }
+        m_recent.insert(upper_bound(m_recent.begin(), m_recent.end(), id, less), id);
+        if (m_recent.size() > 64 && m_recent.size() * m_recent.size() > m_sorted.size()) {
+            // Merge from the back, placing each recent id by binary search:
+            // O(r log n) symbol compares, and the rest is moving integers.
+            size_t i = m_sorted.size(), w = i + m_recent.size();
+            m_sorted.resize(w);
+            auto first = m_sorted.begin();
+            for (size_t k = m_recent.size(); k-- > 0;) {
+                size_t pos = static_cast<size_t>(upper_bound(first, first + static_cast<ptrdiff_t>(i), m_recent[k], less) - first);
+                move_backward(first + static_cast<ptrdiff_t>(pos), first + static_cast<ptrdiff_t>(i), first + static_cast<ptrdiff_t>(w));
+                w -= i - pos;
+                i = pos;
+                m_sorted[--w] = m_recent[k];
+            }
+            m_recent.clear();
+        }
+    }
+
+    PriceColumns columns(PriceFrame* f) {
+        return PriceColumns{f->price.get(), m_drift.data(), m_baseVol.data(), size(),
+                            m_stockRuns.data(), m_stockRuns.size()};
+    }
+
+    void printHeader(const vector<ListColumn>& extra = {}) const {
+        cout << "\n--- Market ---\n";
+        cout << left << setw(8) << "Symbol" << setw(24) << "Name" << right << setw(12) << (extra.empty() ? "Price\n" : "Price");
+        for (auto& c : extra) cout << setw(10) << c.title;
+        if (!extra.empty()) cout << "\n";
+        cout << string(46 + 10 * extra.size(), '-') << "\n";
+    }
+
+    void printRow(SecId id, double price, const vector<ListColumn>& extra = {}) const {
+        cout << left << setw(8) << symbol(id)
+             << setw(24) << m_name[id]
+             << right << setw(12) << util::money(price);
+        for (auto& c : extra) {
+            double v = c.value(id);
+            if (isnan(v)) cout << setw(10) << "-";
+            else cout << setw(10) << util::money(v);
+        }
+        cout << "\n";
+    }
+
+    // Appends the columns for a new symbol; returns its id, or the existing
+    // id (changing nothing) if the symbol is already listed.
+    SecId add(string_view sym, string_view name, double price, double vol, double drift, bool& added) {
+        SecId id = m_symbols.intern(sym);
+        added = id == size();
+        if (!added) return id;
+        PriceFrame* f = front();
+        if (id == f->capacity) publish(f = backFrame(max<size_t>(16, 2 * f->capacity)));
+        f->price[id] = price;
+        f->size.store(id + 1, memory_order_release);
+        m_name.push_back(m_text.store(name));
+        m_baseVol.push_back(vol);
+        m_drift.push_back(drift);
+        m_listeners.emplace_back();
+        m_watchSlot.push_back(0);
+        m_traded.push_back(0);
+        m_adapterSlot.push_back(-1);
+        index(id);
+        return id;
+    }
+
+public:
+    static constexpr SecId npos = SymbolTable::npos;
+
+    Market() {
+        m_frames.push_back(make_unique<PriceFrame>());
+        m_front.store(m_frames.back().get());
+    }
+    Market(const Market&) = delete;
+    Market& operator=(const Market&) = delete;
+
+    // A plain Stock straight into the columns: no Security object, and the
+    // strings are copied into the market's arenas.
+    SecId addStock(string_view sym, string_view name, double price, double vol, double drift = model::kDrift) {
+        bool added;
+        SecId id = add(sym, name, price, vol, drift, added);
+        if (!added) return id;
+        if (!m_stockRuns.empty() && m_stockRuns.back().end == id) ++m_stockRuns.back().end;
+        else m_stockRuns.push_back(IdRange{id, id + 1});
+        return id;
+    }
+
+    SecId addSecurity(unique_ptr<Security> sec) {
+        if (typeid(*sec) == typeid(Stock))
+            return addStock(sec->symbol(), sec->name(), sec->price(), sec->volatility(), sec->drift());
+        bool added;
+        SecId id = add(sec->symbol(), sec->name(), sec->price(), sec->volatility(), sec->drift(), added);
+        if (!added) return id;
+        m_adapterSlot[id] = static_cast<int32_t>(m_adapters.size());
+        m_adapters.push_back(Adapter{id, std::move(sec)});
+        return id;
+    }
+
+    void reserve(size_t n) {
+        m_symbols.reserve(n); m_name.reserve(n);
+        if (n > front()->capacity) publish(backFrame(n));
+        m_baseVol.reserve(n); m_drift.reserve(n);
+        m_listeners.reserve(n); m_watchSlot.reserve(n);
+        m_traded.reserve(n);
+        m_sorted.reserve(n); m_adapterSlot.reserve(n);
+    }
+
+    SecId find(string_view symbol) const { return m_symbols.find(symbol); }
+
+    size_t size() const { return m_name.size(); }
+    string_view symbol(SecId id) const { return m_symbols.name(id); }
+    string_view name(SecId id) const { return m_name[id]; }
+    double volatility(SecId id) const { return m_baseVol[id]; }
+    double drift(SecId id) const { return m_drift[id]; }
+    double price(SecId id) const { return snapshot()[id]; }
+    // Every price as of the latest published tick.
+    PriceView snapshot() const { return PriceView(m_front); }
+    const double* prices() const { return front()->price.get(); }
+
+    const vector<IdRange>& stockRuns() const { return m_stockRuns; }
+    size_t adapterCount() const { return m_adapters.size(); }
+    // The Security behind an adapter instrument; nullptr for plain Stocks.
+    const Security* adapter(SecId id) const {
+        return m_adapterSlot[id] < 0 ? nullptr : m_adapters[static_cast<size_t>(m_adapterSlot[id])].sec.get();
+    }
+
+    void tick(std::mt19937& rng, int times = 1) {
+        const simd::Kernels& k = simd::kernels();
+        if (times <= 0) return;
+        if (stepwise(times)) {
+            for (int t = 0; t < times; ++t) tick(rng);
+            return;
+        }
+        m_noise.resize(simd::kBlock + 1);
+        const double* src = prices();
+        PriceFrame* f = spareFrame();
+        double* price = f->price.get();
+        for (int t = 0; t < times; ++t) {
+            for (const IdRange& r : m_stockRuns)
+                simd::gbmStep(k, rng, price + r.begin, m_drift.data() + r.begin, m_baseVol.data() + r.begin,
+                              r.end - r.begin, m_noise.data(), t == 0 ? src + r.begin : nullptr);
+            for (Adapter& a : m_adapters) {
+                a.sec->updatePrice(rng);
+                price[a.id] = a.sec->price();
+            }
+        }
+        m_tick += static_cast<uint64_t>(times);
+        publish(f);
+        notify();
+    }
+
+    // Takes up to `times` steps from src; returns how many it had.
+    int tick(PriceSource& src, int times = 1) {
+        if (stepwise(times)) {
+            int done = 0;
+            while (done < times && tick(src) == 1) ++done;
+            return done;
+        }
+        PriceFrame* f = backFrame();
+        PriceColumns cols = columns(f);
+        int done = 0;
+        while (done < times && src.advance(cols)) ++done;
+        if (done == 0) { m_spare.push_back(f); return 0; }
+        m_tick += static_cast<uint64_t>(done);
+        publish(f);
+        notify();
+        return done;
+    }
+
+    // Sharded tick driven by counter-based streams: every price depends only
+    // on (seed, id, tick index), so results are bit-identical for any pool size.
+    // Adapter instruments tick serially afterwards, each from an mt19937
+    // seeded by its own Philox counter.
+    void tick(ThreadPool& pool, uint64_t seed, int times = 1) {
+        if (times <= 0) return;
+        if (stepwise(times)) {
+            for (int t = 0; t < times; ++t) tick(pool, seed);
+            return;
+        }
+        const simd::Kernels& k = simd::kernels();
+        const size_t n = size();
+        const size_t blocks = (n + simd::kBlock - 1) / simd::kBlock;
+        const uint64_t first = m_tick;
+        const double* src = prices();
+        PriceFrame* f = spareFrame();
+        double* price = f->price.get();
+        pool.run(blocks, [&](size_t b) {
+            const size_t i = b * simd::kBlock, len = min(simd::kBlock, n - i);
+            copy_n(src + i, len, price + i);
+            auto run = upper_bound(m_stockRuns.begin(), m_stockRuns.end(), i,
+                                   [](size_t x, const IdRange& r) { return x < r.end; });
+            if (run == m_stockRuns.end() || run->begin >= i + len) return;
+            double z[simd::kBlock + 1];
+            for (int t = 0; t < times; ++t) {
+                simd::philoxNormals(k, seed, first + static_cast<uint64_t>(t), b, z, len);
+                for (auto r = run; r != m_stockRuns.end() && r->begin < i + len; ++r) {
+                    size_t s = max<size_t>(r->begin, i), e = min<size_t>(r->end, i + len);
+                    k.gbm(price + s, m_drift.data() + s, m_baseVol.data() + s, z + (s - i), e - s);
+                }
+            }
+        });
+        const array<uint32_t, 2> key{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)};
+        for (Adapter& a : m_adapters) {
+            for (int t = 0; t < times; ++t) {
+                uint64_t tk = first + static_cast<uint64_t>(t);
+                mt19937 rng(philox::block({static_cast<uint32_t>(tk), static_cast<uint32_t>(tk >> 32), a.id, ~0u}, key)[0]);
+                a.sec->updatePrice(rng);
+            }
+            price[a.id] = a.sec->price();
+        }
+        m_tick += static_cast<uint64_t>(times);
+        publish(f);
+        notify();
+    }
+
+    uint64_t tickCount() const { return m_tick; }
+
+    void watch(SecId id, PriceListener* l) {
+        lock_guard<mutex> lk(m_watchMutex);
+        auto& ls = m_listeners[id];
+        if (ls.empty()) {
+            m_watchSlot[id] = static_cast<uint32_t>(m_watched.size());
+            m_watched.push_back(id);
+        }
+        ls.push_back(l);
+    }
+
+    void unwatch(SecId id, PriceListener* l) {
+        lock_guard<mutex> lk(m_watchMutex);
+        auto& ls = m_listeners[id];
+        auto it = std::find(ls.begin(), ls.end(), l);
+        if (it == ls.end()) return;
+        *it = ls.back(); ls.pop_back();
+        if (ls.empty()) {
+            SecId last = m_watched.back();
+            m_watched[m_watchSlot[id]] = last;
+            m_watchSlot[last] = m_watchSlot[id];
+            m_watched.pop_back();
+        }
+    }
+
+    void subscribe(TickSink* s) {
+        lock_guard<mutex> lk(m_watchMutex);
+        m_sinks.push_back(s);
+    }
+
+    void unsubscribe(TickSink* s) {
+        lock_guard<mutex> lk(m_watchMutex);
+        m_sinks.erase(std::remove(m_sinks.begin(), m_sinks.end(), s), m_sinks.end());
+    }
+
+    // Records qty traded in id. Safe from any thread, but not during add().
+    void trade(SecId id, long long qty) { __atomic_fetch_add(&m_traded[id], qty, __ATOMIC_RELAXED); }
+    int64_t traded(SecId id) const { return __atomic_load_n(&m_traded[id], __ATOMIC_RELAXED); }
+
+    // Pushes current prices to listeners, then the whole columns to sinks;
+    // listeners cost O(watched ids), not O(universe).
+    void notify() {
+        const double* price = prices();
+        lock_guard<mutex> lk(m_watchMutex);
+        for (SecId id : m_watched)
+            for (PriceListener* l : m_listeners[id]) l->onPrice(id, price[id]);
+        if (m_sinks.empty()) return;
+        TickColumns cols{price, m_traded.data(), size(), m_tick};
+        for (TickSink* s : m_sinks) s->onTick(cols);
+    }
+
+    // Calls fn(id) for up to limit ids in symbol order, starting at the
+    // offset-th. Seeking costs O(log^2 n); each id after that is O(1).
+    template <class Fn>
+    void forEachBySymbol(size_t offset, size_t limit, Fn&& fn) const {
+        // j = how many of m_recent rank below offset in the merged order.
+        size_t lo = 0, hi = m_recent.size();
+        auto less = [this](SecId a, SecId b) { return symbolLess(a, b); };
+        while (lo < hi) {
+            size_t j = lo + (hi - lo) / 2;
+            size_t rank = j + static_cast<size_t>(lower_bound(m_sorted.begin(), m_sorted.end(), m_recent[j], less) - m_sorted.begin());
+            if (rank < offset) lo = j + 1; else hi = j;
+        }
+        size_t j = lo;
+        if (offset - j > m_sorted.size()) return;
+        size_t i = offset - j;
+        for (; limit > 0 && (i < m_sorted.size() || j < m_recent.size()); --limit) {
+            if (j == m_recent.size() || (i < m_sorted.size() && less(m_sorted[i], m_recent[j]))) fn(m_sorted[i++]);
+            else fn(m_recent[j++]);
+        }
+    }
+
+    // The n highest-priced ids in view, highest first; O(size * log n).
+    vector<SecId> topByPrice(const PriceView& view, size_t n) const {
+        vector<SecId> ids(view.size());
+        iota(ids.begin(), ids.end(), SecId{0});
+        n = min(n, ids.size());
+        const double* p = view.data();
+        partial_sort(ids.begin(), ids.begin() + static_cast<ptrdiff_t>(n), ids.end(), [this, p](SecId a, SecId b) {
+            return p[a] != p[b] ? p[a] > p[b] : symbolLess(a, b);
+        });
+        ids.resize(n);
+        return ids;
+    }
+    vector<SecId> topByPrice(size_t n) const { return topByPrice(snapshot(), n); }
+
+    // Prints limit rows in symbol order starting at offset, with any extra
+    // columns (e.g. Indicators::column) after the price.
+    void list(size_t offset = 0, size_t limit = numeric_limits<size_t>::max(),
+              const vector<ListColumn>& extra = {}) const {
+        PriceView view = snapshot();
+        printHeader(extra);
+        forEachBySymbol(offset, limit, [&](SecId id) { printRow(id, view[id], extra); });
+        size_t end = min(size(), offset + min(limit, size()));
+        if (offset > 0 || end < size())
+            cout << "(" << (end > offset ? offset + 1 : end) << "-" << end << " of " << size() << ")\n";
+    }
+
+    void listTop(size_t n) const {
+        PriceView view = snapshot();
+        printHeader();
+        for (SecId id : topByPrice(view, n)) printRow(id, view[id]);
+    }
+};
+
+// depth frames of width values each, every frame 64-byte aligned in one
+// allocation; push() overwrites the oldest once full.
+template <class T>
+class ColumnRing {
+    struct Free {
+        void operator()(T* p) const { ::operator delete[](p, align_val_t{64}); }
+    };
+
+    size_t m_width, m_stride, m_depth;
+    size_t m_head = 0, m_count = 0;
+    unique_ptr<T[], Free> m_data;
+
+public:
+    ColumnRing(size_t width, size_t depth)
+        : m_width(width), m_stride((width * sizeof(T) + 63) / 64 * 64 / sizeof(T)), m_depth(depth) {
+        if (depth == 0) throw runtime_error("History depth must be positive.");
+        m_data.reset(static_cast<T*>(::operator new[](m_stride * depth * sizeof(T), align_val_t{64})));
+        fill_n(m_data.get(), m_stride * depth, T());
+    }
+
+    // The frame the next push() publishes; fill it first.
+    T* back() { return m_data.get() + m_head * m_stride; }
+    void push() {
+        m_head = m_head + 1 == m_depth ? 0 : m_head + 1;
+        m_count = min(m_count + 1, m_depth);
+    }
+
+    // age 0 is the latest push; requires age < count().
+    const T* frame(size_t age) const {
+        size_t i = m_head + m_depth - 1 - age;
+        return m_data.get() + (i >= m_depth ? i - m_depth : i) * m_stride;
+    }
+
+    size_t width() const { return m_width; }
+    size_t depth() const { return m_depth; }
+    size_t count() const { return m_count; }
+};
+
+// The last depth ticks of every price, frame per tick (SoA across the
+// universe), so recording a tick is one contiguous copy and never allocates.
+// Covers the first `securities` ids (default: the market's size when built);
+// later listings are not recorded. Ticking thread only.
+class PriceHistory : public TickSink {
+    Market& m_market;
+    ColumnRing<double> m_price;
+    ColumnRing<uint64_t> m_tick;
+
+public:
+    PriceHistory(Market& market, size_t depth, size_t securities = 0)
+        : m_market(market), m_price(max(securities, market.size()), depth), m_tick(1, depth) {
+        m_market.subscribe(this);
+    }
+    ~PriceHistory() override { m_market.unsubscribe(this); }
+
+    PriceHistory(const PriceHistory&) = delete;
+    PriceHistory& operator=(const PriceHistory&) = delete;
+
+    void onTick(const TickColumns& c) override {
+        copy_n(c.price, min(c.size, m_price.width()), m_price.back());
+        m_price.push();
+        *m_tick.back() = c.tick;
+        m_tick.push();
+    }
+
+    size_t count() const { return m_price.count(); }
+    size_t depth() const { return m_price.depth(); }
+    size_t width() const { return m_price.width(); }
+
+    // age 0 is the latest recorded tick; requires age < count().
+    double price(SecId id, size_t age) const { return m_price.frame(age)[id]; }
+    uint64_t tick(size_t age) const { return *m_tick.frame(age); }
+    const double* frame(size_t age) const { return m_price.frame(age); }
+
+    // Copies up to n of id's latest prices into out, oldest first; returns
+    // how many.
+    size_t series(SecId id, double* out, size_t n) const {
+        n = min(n, count());
+        for (size_t k = 0; k < n; ++k) out[k] = price(id, n - 1 - k);
+        return n;
+    }
+};
+
+struct Bar {
+    double open, high, low, close;
+    int64_t volume;
+    uint64_t tick;  // of the bar's last tick
+};
+
+// Rolls ticks into OHLCV bars of one length, streaming: the bar being built
+// is a set of columns updated in place each tick, and a finished bar is
+// copied into fixed-depth rings. Volume is the market's traded quantity
+// over the bar.
+class BarSeries {
+    size_t m_length, m_width;
+    size_t m_filled = 0;  // ticks in the bar being built
+    vector<double> m_open, m_high, m_low, m_close;
+    vector<int64_t> m_volumeAt;  // cumulative volume when the bar opened
+    ColumnRing<double> m_o, m_h, m_l, m_c;
+    ColumnRing<int64_t> m_v;
+    ColumnRing<uint64_t> m_tick;
+
+public:
+    BarSeries(size_t length, size_t width, size_t depth, const Market& market)
+        : m_length(length), m_width(width),
+          m_open(width), m_high(width), m_low(width), m_close(width), m_volumeAt(width),
+          m_o(width, depth), m_h(width, depth), m_l(width, depth), m_c(width, depth),
+          m_v(width, depth), m_tick(1, depth) {
+        if (length == 0) throw runtime_error("Bar length must be positive.");
+        for (SecId id = 0; id < min<size_t>(width, market.size()); ++id) m_volumeAt[id] = market.traded(id);
+    }
+
+    void add(const TickColumns& c) {
+        const size_t n = min(c.size, m_width);
+        const double* p = c.price;
+        if (m_filled == 0) {
+            copy_n(p, n, m_open.data());
+            copy_n(p, n, m_high.data());
+            copy_n(p, n, m_low.data());
+        } else {
+            double* h = m_high.data();
+            double* l = m_low.data();
+            for (size_t i = 0; i < n; ++i) {
+                h[i] = max(h[i], p[i]);
+                l[i] = min(l[i], p[i]);
+            }
+        }
+        if (++m_filled < m_length) return;
+        copy_n(m_open.data(), n, m_o.back());
+        copy_n(m_high.data(), n, m_h.back());
+        copy_n(m_low.data(), n, m_l.back());
+        copy_n(p, n, m_c.back());
+        int64_t* v = m_v.back();
+        for (size_t i = 0; i < n; ++i) {
+            v[i] = c.volume[i] - m_volumeAt[i];
+            m_volumeAt[i] = c.volume[i];
+        }
+        *m_tick.back() = c.tick;
+        m_o.push(); m_h.push(); m_l.push(); m_c.push(); m_v.push(); m_tick.push();
+        m_filled = 0;
+    }
+
+    size_t length() const { return m_length; }
+    size_t count() const { return m_o.count(); }
+
+    // age 0 is the latest finished bar; requires age < count().
+    Bar bar(SecId id, size_t age) const {
+        return Bar{m_o.frame(age)[id], m_h.frame(age)[id], m_l.frame(age)[id], m_c.frame(age)[id],
+                   m_v.frame(age)[id], *m_tick.frame(age)};
+    }
+};
+
+// 1-, 5- and 60-tick bars (or any lengths) over the first `securities` ids,
+// kept `depth` bars deep per length. Ticking thread only.
+class BarAggregator : public TickSink {
+    Market& m_market;
+    vector<BarSeries> m_series;
+
+public:
+    BarAggregator(Market& market, size_t depth, size_t securities = 0, vector<size_t> lengths = {1, 5, 60})
+        : m_market(market) {
+        size_t width = max(securities, market.size());
+        m_series.reserve(lengths.size());
+        for (size_t len : lengths) m_series.emplace_back(len, width, depth, market);
+        m_market.subscribe(this);
+    }
+    ~BarAggregator() override { m_market.unsubscribe(this); }
+
+    BarAggregator(const BarAggregator&) = delete;
+    BarAggregator& operator=(const BarAggregator&) = delete;
+
+    void onTick(const TickColumns& c) override {
+        for (auto& s : m_series) s.add(c);
+    }
+
+    // The series for bars of `length` ticks.
+    const BarSeries& series(size_t length) const {
+        for (auto& s : m_series)
+            if (s.length() == length) return s;
+        throw runtime_error("No bars of that length.");
+    }
+    const vector<BarSeries>& all() const { return m_series; }
+};
+
+// Streaming technical indicators over the first `securities` ids: SMA and
+// Bollinger bands over a window (sliding Welford mean and variance, with
+// the window's prices in a ring), EMA, MACD with its signal line, and Wilder
+// RSI. Every running quantity is one column across the universe, so a tick
+// is a single fused pass over the columns, two lanes at a time, and O(1) per
+// id. Values read as NaN until enough ticks have been seen. Ticking thread
+// only.
+class Indicators : public TickSink {
+public:
+    enum class Kind : uint8_t { SMA, EMA, RSI, MACD, Signal, UpperBand, LowerBand };
+
+    struct Periods {
+        size_t sma = 20;  // also the Bollinger window
+        size_t ema = 20;
+        size_t rsi = 14;
+        size_t fast = 12, slow = 26, signal = 9;  // MACD
+        double bands = 2;  // Bollinger width in standard deviations
+    };
+
+private:
+    struct Coef {
+        double inv;     // 1 / ticks in the window, including this one
+        double ema, fast, slow, signal, rsi;
+    };
+
+    Market& m_market;
+    Periods m_periods;
+    size_t m_width;
+    size_t m_count = 0;  // ticks seen
+    ColumnRing<double> m_window;
+    vector<double> m_mean, m_m2, m_ema, m_fast, m_slow, m_signal, m_gain, m_loss, m_prev;
+
+    // Ids [i, i + W) of one tick; `sliding` once the window is full, when
+    // w holds the prices leaving it.
+    template <int W>
+    __attribute__((always_inline)) void step(size_t i, const double* p, double* w, const Coef& k, bool sliding) {
+        using D = typename simd::Lanes<W>::D;
+        D x, prev, mean, m2, ema, fast, slow, signal, gain, loss;
+        simd::load(x, p + i); simd::load(prev, m_prev.data() + i);
+        simd::load(mean, m_mean.data() + i); simd::load(m2, m_m2.data() + i);
+        simd::load(ema, m_ema.data() + i); simd::load(fast, m_fast.data() + i);
+        simd::load(slow, m_slow.data() + i); simd::load(signal, m_signal.data() + i);
+        simd::load(gain, m_gain.data() + i); simd::load(loss, m_loss.data() + i);
+        if (sliding) {
+            D old;
+            simd::load(old, w + i);
+            D next = mean + (x - old) * k.inv;
+            m2 += (x - old) * (x - next + old - mean);
+            mean = next;
+        } else {
+            D d = x - mean;
+            mean += d * k.inv;
+            m2 += d * (x - mean);
+        }
+        ema += (x - ema) * k.ema;
+        fast += (x - fast) * k.fast;
+        slow += (x - slow) * k.slow;
+        signal += (fast - slow - signal) * k.signal;
+        D d = x - prev, zero{};
+        gain += ((d > zero ? d : zero) - gain) * k.rsi;
+        loss += ((d < zero ? -d : zero) - loss) * k.rsi;
+        simd::store(w + i, x); simd::store(m_prev.data() + i, x);
+        simd::store(m_mean.data() + i, mean); simd::store(m_m2.data() + i, m2);
+        simd::store(m_ema.data() + i, ema); simd::store(m_fast.data() + i, fast);
+        simd::store(m_slow.data() + i, slow); simd::store(m_signal.data() + i, signal);
+        simd::store(m_gain.data() + i, gain); simd::store(m_loss.data() + i, loss);
+    }
+
+    bool ready(Kind k) const {
+        switch (k) {
+            case Kind::SMA: case Kind::UpperBand: case Kind::LowerBand: return m_count >= m_periods.sma;
+            case Kind::EMA: return m_count >= m_periods.ema;
+            case Kind::RSI: return m_count > m_periods.rsi;
+            case Kind::MACD: return m_count >= m_periods.slow;
+            case Kind::Signal: return m_count >= m_periods.slow + m_periods.signal - 1;
+        }
+        return false;
+    }
+
+    static double alpha(size_t period) { return 2.0 / (static_cast<double>(period) + 1); }
+
+public:
+    explicit Indicators(Market& market, size_t securities = 0) : Indicators(market, Periods(), securities) {}
+
+    Indicators(Market& market, const Periods& periods, size_t securities = 0)
+        : m_market(market), m_periods(periods), m_width(max(securities, market.size())),
+          m_window(m_width, max<size_t>(periods.sma, 1)),
+          m_mean(m_width), m_m2(m_width), m_ema(m_width), m_fast(m_width), m_slow(m_width),
+          m_signal(m_width), m_gain(m_width), m_loss(m_width), m_prev(m_width) {
+        if (!periods.sma || !periods.ema || !periods.rsi || !periods.fast || !periods.slow || !periods.signal)
+            throw runtime_error("Indicator periods must be positive.");
+        m_market.subscribe(this);
+    }
+    ~Indicators() override { m_market.unsubscribe(this); }
+
+    Indicators(const Indicators&) = delete;
+    Indicators& operator=(const Indicators&) = delete;
+
+    void onTick(const TickColumns& c) override {
+        const size_t n = min(c.size, m_width);
+        const double* p = c.price;
+        double* w = m_window.back();
+        if (m_count++ == 0) {
+            for (double* col : {w, m_prev.data(), m_mean.data(), m_ema.data(), m_fast.data(), m_slow.data()})
+                copy_n(p, n, col);
+            m_window.push();
+            return;
+        }
+        const bool sliding = m_count > m_periods.sma;
+        const Coef k{1.0 / static_cast<double>(min(m_count, m_periods.sma)),
+                     alpha(m_periods.ema), alpha(m_periods.fast), alpha(m_periods.slow), alpha(m_periods.signal),
+                     1.0 / static_cast<double>(min(m_count - 1, m_periods.rsi))};
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2) step<2>(i, p, w, k, sliding);
+        for (; i < n; ++i) step<1>(i, p, w, k, sliding);
+        m_window.push();
+    }
+
+    size_t count() const { return m_count; }
+    const Periods& periods() const { return m_periods; }
+
+    // NaN until enough ticks have been seen, or for ids past the width.
+    double value(Kind k, SecId id) const {
+        if (id >= m_width || !ready(k)) return numeric_limits<double>::quiet_NaN();
+        switch (k) {
+            case Kind::SMA: return m_mean[id];
+            case Kind::EMA: return m_ema[id];
+            case Kind::RSI: {
+                double g = m_gain[id], l = m_loss[id];
+                if (l == 0) return g == 0 ? 50 : 100;
+                return 100 - 100 / (1 + g / l);
+            }
+            case Kind::MACD: return m_fast[id] - m_slow[id];
+            case Kind::Signal: return m_signal[id];
+            case Kind::UpperBand: case Kind::LowerBand: {
+                double sd = sqrt(max(m_m2[id], 0.0) / static_cast<double>(m_periods.sma));
+                return m_mean[id] + (k == Kind::UpperBand ? m_periods.bands : -m_periods.bands) * sd;
+            }
+        }
+        return numeric_limits<double>::quiet_NaN();
+    }
+
+    // A Market::list column showing k.
+    ListColumn column(Kind k) const {
+        static const char* kTitles[] = {"SMA", "EMA", "RSI", "MACD", "Signal", "BB+", "BB-"};
+        string title = kTitles[static_cast<int>(k)];
+        if (k == Kind::SMA) title += "(" + to_string(m_periods.sma) + ")";
+        if (k == Kind::EMA) title += "(" + to_string(m_periods.ema) + ")";
+        if (k == Kind::RSI) title += "(" + to_string(m_periods.rsi) + ")";
+        return ListColumn{title, [this, k](SecId id) { return value(k, id); }};
+    }
+};
+
+
+// Historical tick file: Header, symbolCount Symbol entries and their
+// strings, padding to 8 bytes, then recordCount Records sorted by timestamp.
+// Replayed straight out of an mmap.
+namespace ticks {
+    constexpr char kMagic[8] = {'P', 'F', 'T', 'I', 'C', 'K', 'S', '\0'};
+    constexpr uint32_t kVersion = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t headerSize;
+        uint64_t symbolCount;
+        uint64_t stringsSize;
+        uint64_t recordOffset;  // 8-byte aligned
+        uint64_t recordCount;
+        uint64_t checksum;      // over the symbol table and strings
+    };
+
+    struct Symbol {
+        uint32_t offset;  // into the strings
+        uint32_t length;
+    };
+
+    struct Record {
+        int64_t timestamp;
+        double price;
+        uint32_t symbol;  // index into the file's symbol table
+        uint32_t pad;
+    };
+    static_assert(sizeof(Record) == 24, "tick records are fixed width");
+
+    inline void write(const string& path, const vector<string>& symbols, const vector<Record>& records) {
+        for (size_t i = 1; i < records.size(); ++i)
+            if (records[i].timestamp < records[i - 1].timestamp) throw runtime_error("Ticks must be sorted by timestamp.");
+        string table(symbols.size() * sizeof(Symbol), '\0'), strings;
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            Symbol s{static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(symbols[i].size())};
+            memcpy(&table[i * sizeof s], &s, sizeof s);
+            strings += symbols[i];
+        }
+        table += strings;
+        Header hdr{};
+        memcpy(hdr.magic, kMagic, sizeof hdr.magic);
+        hdr.version = kVersion;
+        hdr.headerSize = sizeof hdr;
+        hdr.symbolCount = symbols.size();
+        hdr.stringsSize = strings.size();
+        hdr.recordOffset = (sizeof hdr + table.size() + 7) & ~uint64_t(7);
+        hdr.recordCount = records.size();
+        hdr.checksum = util::checksum(table.data(), table.size());
+        table.resize(hdr.recordOffset - sizeof hdr, '\0');
+
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw runtime_error("Failed to open tick file.");
+        bool ok = util::writeAll(fd, reinterpret_cast<const char*>(&hdr), sizeof hdr)
+               && util::writeAll(fd, table.data(), table.size())
+               && util::writeAll(fd, reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+        ok = ::close(fd) == 0 && ok;
+        if (!ok) throw runtime_error("Failed to write tick file.");
+    }
+}
+
+// Replays a tick file. Each advance() applies every record that shares the
+// next timestamp, walking the mapping with a pointer bump; file symbols are
+// mapped to SecIds once, up front, and ones the market does not list are
+// skipped. seek() only moves the cursor: a security keeps its current price
+// until its next record after the seek point.
+class ReplaySource : public PriceSource {
+    MappedFile m_file;
+    const ticks::Record* m_begin = nullptr;
+    const ticks::Record* m_end = nullptr;
+    const ticks::Record* m_cur = nullptr;
+    vector<SecId> m_remap;  // file symbol index -> SecId, or Market::npos
+
+public:
+    ReplaySource(const string& path, const Market& mkt) : m_file(path) {
+        if (!m_file) throw runtime_error("Cannot read tick file " + path);
+        ticks::Header hdr;
+        if (m_file.size() < sizeof hdr) throw runtime_error("Tick file truncated.");
+        memcpy(&hdr, m_file.data(), sizeof hdr);
+        if (memcmp(hdr.magic, ticks::kMagic, sizeof hdr.magic) != 0) throw runtime_error("Not a tick file.");
+        if (hdr.version != ticks::kVersion || hdr.headerSize != sizeof hdr) throw runtime_error("Unsupported tick file version.");
+        const uint64_t tableBytes = hdr.symbolCount * sizeof(ticks::Symbol);
+        if (hdr.symbolCount > m_file.size() / sizeof(ticks::Symbol) || hdr.stringsSize > m_file.size()
+            || hdr.recordOffset % alignof(ticks::Record) != 0
+            || hdr.recordOffset < sizeof hdr + tableBytes + hdr.stringsSize
+            || hdr.recordOffset > m_file.size()
+            || hdr.recordCount != (m_file.size() - hdr.recordOffset) / sizeof(ticks::Record))
+            throw runtime_error("Tick file truncated.");
+        const char* table = m_file.data() + sizeof hdr;
+        if (util::checksum(table, tableBytes + hdr.stringsSize) != hdr.checksum)
+            throw runtime_error("Tick file checksum mismatch.");
+
+        const char* strings = table + tableBytes;
+        m_remap.resize(hdr.symbolCount);
+        string sym;
+        for (uint64_t i = 0; i < hdr.symbolCount; ++i) {
+            ticks::Symbol s;
+            memcpy(&s, table + i * sizeof s, sizeof s);
+            if (uint64_t{s.offset} + s.length > hdr.stringsSize) throw runtime_error("Tick file corrupt.");
+            sym.assign(strings + s.offset, s.length);
+            m_remap[i] = mkt.find(sym);
+        }
+        m_begin = m_cur = reinterpret_cast<const ticks::Record*>(m_file.data() + hdr.recordOffset);
+        m_end = m_begin + hdr.recordCount;
+    }
+
+    bool advance(const PriceColumns& c) override {
+        if (m_cur == m_end) return false;
+        const int64_t ts = m_cur->timestamp;
+        const size_t nsym = m_remap.size();
+        for (; m_cur != m_end && m_cur->timestamp == ts; ++m_cur) {
+            if (m_cur->symbol >= nsym) continue;
+            SecId id = m_remap[m_cur->symbol];
+            if (id < c.size) c.price[id] = m_cur->price;
+        }
+        return true;
+    }
+
+    // Positions the cursor on the first record at or after timestamp.
+    void seek(int64_t timestamp) {
+        m_cur = lower_bound(m_begin, m_end, timestamp,
+                            [](const ticks::Record& r, int64_t t) { return r.timestamp < t; });
+    }
+
+    void rewind() { m_cur = m_begin; }
+    bool done() const { return m_cur == m_end; }
+    // Timestamp the next advance() applies; only meaningful if !done().
+    int64_t timestamp() const { return m_cur->timestamp; }
+    size_t size() const { return static_cast<size_t>(m_end - m_begin); }
+    size_t position() const { return static_cast<size_t>(m_cur - m_begin); }
+};
+
+// Gorilla-style time-series compression (Pelkonen et al., VLDB 2015). A
+// series starts with its first timestamp and value raw; after that each
+// timestamp is a delta-of-delta in a variable-width bucket and each value
+// is XORed with the previous one, storing only the meaningful bits.
+namespace gorilla {
+    // Most bits one sample can take after the first: 4 + 64 for the
+    // timestamp, 2 + 5 + 6 + 64 for the value.
+    constexpr size_t kMaxSampleBits = 145;
+
+    // MSB-first bits into zeroed words the caller owns.
+    class BitWriter {
+        uint64_t* m_words;
+        size_t m_bits;
+
+    public:
+        BitWriter(uint64_t* words, size_t bits) : m_words(words), m_bits(bits) {}
+
+        // The low n (1..64) bits of v.
+        void put(uint64_t v, unsigned n) {
+            if (n < 64) v &= (uint64_t{1} << n) - 1;
+            size_t w = m_bits >> 6;
+            unsigned off = m_bits & 63;
+            if (off + n <= 64) {
+                m_words[w] |= v << (64 - off - n);
+            } else {
+                unsigned lo = off + n - 64;
+                m_words[w] |= v >> lo;
+                m_words[w + 1] |= v << (64 - lo);
+            }
+            m_bits += n;
+        }
+
+        size_t bits() const { return m_bits; }
+    };
+
+    class BitReader {
+        const uint64_t* m_words;
+        size_t m_bits = 0;
+
+    public:
+        explicit BitReader(const uint64_t* words) : m_words(words) {}
+
+        uint64_t get(unsigned n) {
+            size_t w = m_bits >> 6;
+            unsigned off = m_bits & 63;
+            m_bits += n;
+            uint64_t a = m_words[w] << off;
+            if (off + n <= 64) return a >> (64 - n);
+            return (a >> (64 - n)) | (m_words[w + 1] >> (128 - off - n));
+        }
+
+        bool bit() { return get(1) != 0; }
+    };
+
+    // The running state of one series, encoding or decoding.
+    struct State {
+        int64_t time = 0, delta = 0;
+        uint64_t value = 0;
+        uint8_t leading = 0xff, trailing = 0;  // leading 0xff: no window yet
+        uint32_t count = 0;
+    };
+
+    inline void encode(BitWriter& out, State& s, int64_t time, double price) {
+        uint64_t v;
+        memcpy(&v, &price, sizeof v);
+        if (s.count++ == 0) {
+            out.put(static_cast<uint64_t>(time), 64);
+            out.put(v, 64);
+            s.time = time;
+            s.value = v;
+            return;
+        }
+        int64_t delta = time - s.time;
+        int64_t dod = delta - s.delta;
+        if (dod == 0) out.put(0, 1);
+        else if (dod >= -63 && dod <= 64) { out.put(0b10, 2); out.put(static_cast<uint64_t>(dod), 7); }
+        else if (dod >= -255 && dod <= 256) { out.put(0b110, 3); out.put(static_cast<uint64_t>(dod), 9); }
+        else if (dod >= -2047 && dod <= 2048) { out.put(0b1110, 4); out.put(static_cast<uint64_t>(dod), 12); }
+        else { out.put(0b1111, 4); out.put(static_cast<uint64_t>(dod), 64); }
+        s.time = time;
+        s.delta = delta;
+
+        uint64_t x = v ^ s.value;
+        s.value = v;
+        if (x == 0) { out.put(0, 1); return; }
+        unsigned leading = min(__builtin_clzll(x), 31), trailing = __builtin_ctzll(x);
+        if (s.leading != 0xff && leading >= s.leading && trailing >= s.trailing) {
+            out.put(0b10, 2);
+            out.put(x >> s.trailing, 64 - s.leading - s.trailing);
+            return;
+        }
+        unsigned meaningful = 64 - leading - trailing;
+        out.put(0b11, 2);
+        out.put(leading, 5);
+        out.put(meaningful & 63, 6);  // 64 stored as 0
+        out.put(x >> trailing, meaningful);
+        s.leading = static_cast<uint8_t>(leading);
+        s.trailing = static_cast<uint8_t>(trailing);
+    }
+
+    // The inverse of encode, one sample per call.
+    inline void decode(BitReader& in, State& s, int64_t& time, double& price) {
+        if (s.count++ == 0) {
+            s.time = static_cast<int64_t>(in.get(64));
+            s.value = in.get(64);
+        } else {
+            int64_t dod = 0;
+            if (in.bit()) {
+                unsigned width = !in.bit() ? 7 : !in.bit() ? 9 : !in.bit() ? 12 : 64;
+                uint64_t raw = in.get(width);
+                dod = width == 64 ? static_cast<int64_t>(raw)
+                                  : static_cast<int64_t>(raw << (64 - width)) >> (64 - width);
+                // The positive bucket edges (64, 256, 2048) wrap to the negative end.
+                if (width < 64 && dod == -(int64_t{1} << (width - 1))) dod = -dod;
+            }
+            s.delta += dod;
+            s.time += s.delta;
+            if (in.bit()) {
+                if (in.bit()) {
+                    s.leading = static_cast<uint8_t>(in.get(5));
+                    unsigned meaningful = static_cast<unsigned>(in.get(6));
+                    if (meaningful == 0) meaningful = 64;
+                    s.trailing = static_cast<uint8_t>(64 - s.leading - meaningful);
+                }
+                s.value ^= in.get(64 - s.leading - s.trailing) << s.trailing;
+            }
+        }
+        time = s.time;
+        memcpy(&price, &s.value, sizeof price);
+    }
+}
+
+// Every tick of every price, Gorilla-compressed into fixed-size blocks, one
+// open block per security in memory. A block that fills up is sealed and
+// spilled to `path` (staged, then appended in large writes); an index per
+// security of each sealed block's time range serves range queries, so
+// scan() reads and decodes only the blocks that overlap. The store creates
+// the file and unlinks it on destruction; an existing file is an error
+// unless overwrite is set. Timestamps are Market tick numbers when fed by ticks.
+// Ticking thread only.
+class TickStore : public TickSink {
+public:
+    struct Stats {
+        uint64_t samples = 0, blocks = 0;
+        uint64_t storedBytes = 0;  // sealed blocks plus the used part of open ones
+        double ratio() const { return storedBytes ? static_cast<double>(samples) * 16 / static_cast<double>(storedBytes) : 0; }
+    };
+
+private:
+    // On disk each sealed block is a BlockHeader then blockBytes of bits.
+    struct BlockHeader {
+        uint32_t symbol;
+        uint32_t count;
+        int64_t first, last;
+        uint64_t bits;
+    };
+
+    struct BlockRef {
+        int64_t first, last;
+        uint64_t offset;  // of the header in the file
+    };
+
+    struct Open {
+        gorilla::State state;
+        size_t bits = 0;
+        int64_t first = 0;
+    };
+
+    static constexpr size_t kStageBytes = size_t{1} << 20;
+
+    Market* m_market;
+    string m_path;
+    size_t m_width;
+    size_t m_blockWords;
+    int m_fd = -1;
+    uint64_t m_fileSize = 0;   // flushed
+    string m_stage;            // sealed blocks not yet written
+    vector<uint64_t> m_words;  // open blocks, m_blockWords each
+    vector<Open> m_open;
+    vector<vector<BlockRef>> m_index;  // sealed blocks by SecId, in time order
+    Stats m_stats;
+
+    uint64_t* words(SecId id) { return m_words.data() + id * m_blockWords; }
+    const uint64_t* words(SecId id) const { return m_words.data() + id * m_blockWords; }
+    size_t blockBytes() const { return m_blockWords * 8; }
+
+    void seal(SecId id) {
+        Open& o = m_open[id];
+        BlockHeader h{id, o.state.count, o.first, o.state.time, o.bits};
+        m_index[id].push_back(BlockRef{o.first, o.state.time, m_fileSize + m_stage.size()});
+        m_stage.append(reinterpret_cast<const char*>(&h), sizeof h);
+        m_stage.append(reinterpret_cast<const char*>(words(id)), blockBytes());
+        m_stats.storedBytes += sizeof h + blockBytes() - (o.bits + 7) / 8;
+        ++m_stats.blocks;
+        fill_n(words(id), m_blockWords, uint64_t{0});
+        o = Open();
+        if (m_stage.size() >= kStageBytes) flush();
+    }
+
+    // Copies the sealed block at offset into buf (blockBytes), from the
+    // stage or the file; returns its header.
+    BlockHeader load(uint64_t offset, uint64_t* buf) const {
+        BlockHeader h;
+        if (offset >= m_fileSize) {
+            const char* p = m_stage.data() + (offset - m_fileSize);
+            memcpy(&h, p, sizeof h);
+            memcpy(buf, p + sizeof h, blockBytes());
+            return h;
+        }
+        char* dst[2] = {reinterpret_cast<char*>(&h), reinterpret_cast<char*>(buf)};
+        size_t len[2] = {sizeof h, blockBytes()};
+        for (int k = 0; k < 2; ++k) {
+            for (size_t done = 0; done < len[k];) {
+                ssize_t r = ::pread(m_fd, dst[k] + done, len[k] - done, static_cast<off_t>(offset + done));
+                if (r < 0 && errno == EINTR) continue;
+                if (r <= 0) throw runtime_error("Failed to read tick store.");
+                done += static_cast<size_t>(r);
+            }
+            offset += len[k];
+        }
+        return h;
+    }
+
+    template <class Fn>
+    static void decodeBlock(const uint64_t* w, uint32_t count, int64_t from, int64_t to, Fn& fn) {
+        gorilla::BitReader in(w);
+        gorilla::State s;
+        int64_t t;
+        double px;
+        for (uint32_t i = 0; i < count; ++i) {
+            gorilla::decode(in, s, t, px);
+            if (t > to) return;
+            if (t >= from) fn(t, px);
+        }
+    }
+
+public:
+    // blockBytes is rounded up to whole words and must hold a few samples.
+    TickStore(Market& market, const string& path, size_t blockBytes = 1024, size_t securities = 0,
+              bool overwrite = false)
+        : m_market(&market), m_path(path), m_width(max(securities, market.size())),
+          m_blockWords((blockBytes + 7) / 8), m_words(m_width * m_blockWords), m_open(m_width), m_index(m_width) {
+        if (m_blockWords * 64 < 128 + 4 * gorilla::kMaxSampleBits) throw runtime_error("Tick store blocks are too small.");
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | (overwrite ? O_TRUNC : O_EXCL), 0644);
+        if (m_fd < 0 && errno == EEXIST) throw runtime_error("Tick store file already exists.");
+        if (m_fd < 0) throw runtime_error("Failed to open tick store.");
+        try {
+            m_market->subscribe(this);
+        } catch (...) {
+            ::close(m_fd);
+            ::unlink(m_path.c_str());
+            throw;
+        }
+    }
+
+    ~TickStore() override {
+        m_market->unsubscribe(this);
+        ::close(m_fd);
+        ::unlink(m_path.c_str());
+    }
+
+    TickStore(const TickStore&) = delete;
+    TickStore& operator=(const TickStore&) = delete;
+
+    void onTick(const TickColumns& c) override {
+        const size_t n = min(c.size, m_width);
+        const int64_t t = static_cast<int64_t>(c.tick);
+        for (SecId id = 0; id < n; ++id) append(id, t, c.price[id]);
+    }
+
+    // Timestamps must not go backwards within a security.
+    void append(SecId id, int64_t time, double price) {
+        if (id >= m_width) throw runtime_error("Security is outside the tick store.");
+        Open* o = &m_open[id];
+        if (o->state.count && time < o->state.time) throw runtime_error("Ticks must be sorted by timestamp.");
+        if (o->bits + gorilla::kMaxSampleBits > m_blockWords * 64) {
+            seal(id);
+            o = &m_open[id];
+        }
+        if (o->state.count == 0) o->first = time;
+        gorilla::BitWriter out(words(id), o->bits);
+        size_t before = o->bits;
+        gorilla::encode(out, o->state, time, price);
+        o->bits = out.bits();
+        m_stats.storedBytes += (o->bits + 7) / 8 - (before + 7) / 8;
+        ++m_stats.samples;
+    }
+
+    // Writes staged blocks out to the file.
+    void flush() {
+        if (m_stage.empty()) return;
+        if (::lseek(m_fd, 0, SEEK_END) < 0 || !util::writeAll(m_fd, m_stage.data(), m_stage.size()))
+            throw runtime_error("Failed to write tick store.");
+        m_fileSize += m_stage.size();
+        m_stage.clear();
+    }
+
+    // Calls fn(int64_t time, double price) for id's samples with time in
+    // [from, to], oldest first.
+    template <class Fn>
+    void scan(SecId id, int64_t from, int64_t to, Fn&& fn) const {
+        if (id >= m_width) throw runtime_error("Security is outside the tick store.");
+        const auto& idx = m_index[id];
+        auto it = lower_bound(idx.begin(), idx.end(), from, [](const BlockRef& b, int64_t t) { return b.last < t; });
+        if (it != idx.end()) {
+            vector<uint64_t> buf(m_blockWords + 1);
+            for (; it != idx.end() && it->first <= to; ++it) {
+                BlockHeader h = load(it->offset, buf.data());
+                decodeBlock(buf.data(), h.count, from, to, fn);
+            }
+        }
+        const Open& o = m_open[id];
+        if (o.state.count && o.first <= to) decodeBlock(words(id), o.state.count, from, to, fn);
+    }
+
+    size_t width() const { return m_width; }
+    const Stats& stats() const { return m_stats; }
+};
+
+struct Holding {
+    SecId id = Market::npos;
+    long long quantity = 0;
+    Money cost;  // total cost basis
+    Money mark;  // price last folded into the portfolio's cached value
+
+    Money avgCost() const { return quantity ? cost / quantity : Money(); }
+};
+
+// Once bound to a Market, the portfolio watches every symbol it holds and keeps
+// market value and cost basis current from pushed prices, so both valuation
+// reads are O(1). Unbound (or against another market) it falls back to a scan.
+// Market prices are rounded to Money as they arrive, so the cached totals are
+// exact and always equal the scan.
+//
+// Holding nodes and buckets come from a per-portfolio pool, so a large book
+// costs a handful of block allocations, and clear() hands them all back at
+// once.
+//
+// Only the owning thread changes the set of holdings; m_lock orders those
+// changes against onPrice from the ticking thread. Market::watch/unwatch are
+// always called outside m_lock (the market calls onPrice under its own lock).
+class Portfolio : public PriceListener {
+public:
+    using Holdings = pmr::unordered_map<SecId, Holding>;
+
+private:
+    pmr::unsynchronized_pool_resource m_pool;
+    Holdings m_holdings{&m_pool};
+    Market* m_market = nullptr;
+    Money m_value;  // sum of quantity * mark
+    Money m_cost;   // sum of cost
+    mutable SpinLock m_lock;
+
+    struct Totals { Money value, cost, basis; };
+
+    // Totals after adding qty shares for cost to it (end() for a new
+    // holding marked at mark); throws on overflow. Caller holds m_lock.
+    Totals afterAdd(Holdings::const_iterator it, long long qty, Money cost, Money mark) const {
+        bool fresh = it == m_holdings.end();
+        return Totals{m_value + (fresh ? mark : it->second.mark) * qty, m_cost + cost,
+                      (fresh ? Money() : it->second.cost) + cost};
+    }
+
+public:
+    Portfolio() = default;
+    Portfolio(const Portfolio&) = delete;
+    Portfolio& operator=(const Portfolio&) = delete;
+    ~Portfolio() override { unbind(); }
+
+    void bind(Market& mkt) {
+        if (m_market == &mkt) return;
+        unbind();
+        m_market = &mkt;
+        for (auto& kv : m_holdings) mkt.watch(kv.first, this);
+        revalue();
+    }
+
+    void unbind() {
+        if (!m_market) return;
+        for (auto& kv : m_holdings) m_market->unwatch(kv.first, this);
+        m_market = nullptr;
+    }
+
+    // Rebuilds both caches from the current marks (re-read if bound).
+    void revalue() {
+        lock_guard<SpinLock> lk(m_lock);
+        m_value = m_cost = Money();
+        for (auto& kv : m_holdings) {
+            Holding& h = kv.second;
+            if (m_market) h.mark = Money::fromDouble(m_market->price(kv.first));
+            m_value += h.mark * h.quantity;
+            m_cost += h.cost;
+        }
+    }
+
+    void onPrice(SecId id, double price) override {
+        Money mark = Money::fromDouble(price);
+        lock_guard<SpinLock> lk(m_lock);
+        auto it = m_holdings.find(id);
+        if (it == m_holdings.end()) return;
+        Holding& h = it->second;
+        m_value += (mark - h.mark) * h.quantity;
+        h.mark = mark;
+    }
+
+    bool has(SecId id) const {
+        return m_holdings.find(id) != m_holdings.end();
+    }
+
+    const Holdings& all() const { return m_holdings; }
+
+    void buy(SecId id, long long qty, Money price) { add(id, qty, price * qty); }
+
+    // Throws, changing nothing, if add(id, qty, cost) would overflow.
+    void checkAdd(SecId id, long long qty, Money cost) const {
+        Money mark = m_market ? Money::fromDouble(m_market->price(id)) : cost / qty;
+        lock_guard<SpinLock> lk(m_lock);
+        afterAdd(m_holdings.find(id), qty, cost, mark);
+    }
+
+    // Adds qty shares bought for a total of cost.
+    void add(SecId id, long long qty, Money cost) {
+        Money mark = m_market ? Money::fromDouble(m_market->price(id)) : cost / qty;
+        bool added;
+        {
+            lock_guard<SpinLock> lk(m_lock);
+            auto it = m_holdings.find(id);
+            added = it == m_holdings.end();
+            // Everything that can overflow is computed before anything changes.
+            Totals t = afterAdd(it, qty, cost, mark);
+            if (added) it = m_holdings.emplace(id, Holding{id, 0, Money(), mark}).first;
+            it->second.cost = t.basis;
+            it->second.quantity += qty;
+            m_value = t.value;
+            m_cost = t.cost;
+        }
+        if (added && m_market) m_market->watch(id, this);
+    }
+
+    // The cost basis leaving the position when qty shares are sold: its
+    // pro-rata share of the holding's cost. Throws if there are too few.
+    Money saleBasis(SecId id, long long qty) const {
+        auto it = m_holdings.find(id);
+        if (it == m_holdings.end() || it->second.quantity < qty) {
+            throw runtime_error("Not enough shares to sell.");
+        }
+        const Holding& h = it->second;
+        return qty == h.quantity ? h.cost : h.cost.mulDiv(qty, h.quantity);
+    }
+
+    // Returns the realized profit.
+    Money sell(SecId id, long long qty, Money price) {
+        Money basis = saleBasis(id, qty);
+        Money profit = price * qty - basis;
+        auto it = m_holdings.find(id);
+        Holding& h = it->second;
+        bool removed;
+        {
+            lock_guard<SpinLock> lk(m_lock);
+            m_value -= h.mark * qty;
+            m_cost -= basis;
+            h.cost -= basis;
+            h.quantity -= qty;
+            removed = h.quantity == 0;
+            if (removed) m_holdings.erase(it);
+        }
+        if (removed && m_market) m_market->unwatch(id, this);
+        return profit;
+    }
+
+    Money marketValue(const Market& mkt) const {
+        if (&mkt == m_market) { lock_guard<SpinLock> lk(m_lock); return m_value; }
+        PriceView view = mkt.snapshot();
+        Money sum;
+        for (auto& kv : m_holdings) sum += Money::fromDouble(view[kv.first]) * kv.second.quantity;
+        return sum;
+    }
+
+    Money unrealizedPnL(const Market& mkt) const {
+        if (&mkt == m_market) { lock_guard<SpinLock> lk(m_lock); return m_value - m_cost; }
+        PriceView view = mkt.snapshot();
+        Money pnl;
+        for (auto& kv : m_holdings)
+            pnl += Money::fromDouble(view[kv.first]) * kv.second.quantity - kv.second.cost;
+        return pnl;
+    }
+
+    void reserve(size_t n) { m_holdings.reserve(n); }
+
+    void clear() {
+        if (m_market)
+            for (auto& kv : m_holdings) m_market->unwatch(kv.first, this);
+        lock_guard<SpinLock> lk(m_lock);
+        { Holdings empty(&m_pool); m_holdings.swap(empty); }
+        m_pool.release();
+        m_value = m_cost = Money();
+    }
+};
+
+// Binary portfolio snapshot: Header, then holdingCount fixed-width Records,
+// then the symbol string table. Loaded straight out of an mmap.
+namespace snapshot {
+    constexpr char kMagic[8] = {'P', 'F', 'S', 'N', 'A', 'P', '\0', '\0'};
+    constexpr uint32_t kVersion = 3;
+    constexpr uint32_t kHeaderSizeV1 = 56;  // v1 had no journalSeq
+    // v1/v2 stored amounts as doubles (and avgCost, not cost) in the same slots.
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t headerSize;
+        int64_t balance;      // Money units
+        int64_t realizedPnL;  // Money units
+        uint64_t holdingCount;
+        uint64_t stringsSize;
+        uint64_t checksum;    // over everything after the header
+        uint64_t journalSeq;  // last journal record folded into this snapshot (v2)
+    };
+
+    struct Record {
+        uint32_t symOffset;  // into the string table
+        uint32_t symLength;
+        int64_t quantity;
+        int64_t cost;  // total cost basis, Money units
+    };
+    static_assert(sizeof(Record) == 24, "snapshot records are fixed width");
+}
+
+// Write-ahead trade journal. Each append is one write(2), so a process crash
+// loses nothing; a background thread fdatasyncs dirty data every interval,
+// batching many trades into one disk flush. Records carry a sequence number
+// and a checksum, so replay skips what a snapshot already holds and stops
+// cleanly at a torn tail.
+class Journal {
+public:
+    enum class Op : uint8_t { AddFunds = 1, Buy = 2, Sell = 3 };
+
+    struct Entry {
+        uint64_t seq;
+        Op op;
+        int64_t quantity;
+        Money value;  // fill price, or the amount for AddFunds
+        string symbol;
+    };
+
+    static constexpr size_t kCompactEvery = 10000;  // records between snapshots
+
+private:
+    struct Head {
+        uint64_t seq;
+        int64_t quantity;
+        int64_t value;  // Money units, or a double if kMoneyUnits is clear
+        uint8_t op;
+        uint8_t symLength;
+        uint8_t flags;
+        uint8_t pad[5];
+    };
+    static_assert(sizeof(Head) == 32, "journal head is fixed width");
+
+    static constexpr uint8_t kMoneyUnits = 1;  // unset in journals written before Money
+
+    static Money value(const Head& h) {
+        if (h.flags & kMoneyUnits) return Money::fromUnits(h.value);
+        double d;
+        memcpy(&d, &h.value, sizeof d);
+        return Money::fromDouble(d);
+    }
+
+    string m_path;
+    int m_fd = -1;
+    uint64_t m_seq = 0;
+    size_t m_pending = 0;  // records since the last reset
+    uint64_t m_size = 0;   // bytes of valid records
+    uint64_t m_lastAt = 0; // offset of the newest record, while retract() may drop it
+    bool m_retractable = false;
+    mutex m_mutex;
+    condition_variable m_cv;
+    bool m_dirty = false, m_stop = false;
+    chrono::microseconds m_interval;
+    thread m_flusher;
+
+    // Walks valid records from the start of the mapping; returns the byte
+    // offset just past the last valid one.
+    template <class Fn>
+    static size_t scan(const MappedFile& f, Fn&& fn) {
+        size_t off = 0;
+        while (off + sizeof(Head) + 8 <= f.size()) {
+            Head h;
+            memcpy(&h, f.data() + off, sizeof h);
+            size_t len = sizeof h + h.symLength;
+            uint64_t check;
+            if (off + len + 8 > f.size()) break;
+            memcpy(&check, f.data() + off + len, 8);
+            if (check != util::checksum(f.data() + off, len)) break;
+            fn(Entry{h.seq, static_cast<Op>(h.op), h.quantity, value(h),
+                     string(f.data() + off + sizeof h, h.symLength)});
+            off += len + 8;
+        }
+        return off;
+    }
+
+    void flushLoop() {
+        unique_lock<mutex> lk(m_mutex);
+        while (!m_stop) {
+            m_cv.wait_for(lk, m_interval);
+            if (!m_dirty) continue;
+            m_dirty = false;
+            int fd = m_fd;
+            lk.unlock();
+            ::fdatasync(fd);
+            lk.lock();
+        }
+    }
+
+public:
+    // Opens (creating if needed) the journal, dropping any torn tail. New
+    // records are numbered after both the file's last record and startSeq.
+    explicit Journal(string path, uint64_t startSeq = 0,
+                     chrono::microseconds interval = chrono::microseconds(2000))
+        : m_path(std::move(path)), m_seq(startSeq), m_interval(interval) {
+        size_t valid;
+        {
+            MappedFile f(m_path);
+            valid = scan(f, [&](const Entry& e) { m_seq = max(m_seq, e.seq); ++m_pending; });
+        }
+        m_fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (m_fd < 0) throw runtime_error("Failed to open journal.");
+        if (::ftruncate(m_fd, static_cast<off_t>(valid)) != 0) {
+            ::close(m_fd);
+            throw runtime_error("Failed to open journal.");
+        }
+        m_size = valid;
+        m_flusher = thread([this]{ flushLoop(); });
+    }
+
+    ~Journal() {
+        { lock_guard<mutex> lk(m_mutex); m_stop = true; }
+        m_cv.notify_one();
+        m_flusher.join();
+        ::fdatasync(m_fd);
+        ::close(m_fd);
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    uint64_t append(Op op, string_view sym, int64_t qty, Money value) {
+        if (sym.size() > numeric_limits<uint8_t>::max()) throw runtime_error("Symbol too long for journal.");
+        char buf[sizeof(Head) + 256 + 8];
+        lock_guard<mutex> lk(m_mutex);
+        Head h{m_seq + 1, qty, value.units(), static_cast<uint8_t>(op), static_cast<uint8_t>(sym.size()),
+               kMoneyUnits, {}};
+        memcpy(buf, &h, sizeof h);
+        memcpy(buf + sizeof h, sym.data(), sym.size());
+        size_t len = sizeof h + sym.size();
+        uint64_t check = util::checksum(buf, len);
+        memcpy(buf + len, &check, 8);
+        if (!util::writeAll(m_fd, buf, len + 8)) {
+            // Drop a torn record so later appends are not stranded behind it.
+            if (::ftruncate(m_fd, static_cast<off_t>(m_size)) != 0) m_retractable = false;
+            throw runtime_error("Journal write failed.");
+        }
+        m_lastAt = m_size;
+        m_size += len + 8;
+        m_retractable = true;
+        m_dirty = true;
+        ++m_pending;
+        return ++m_seq;
+    }
+
+    // Drops record seq if it is still the newest one, e.g. one side of a
+    // trade whose other side failed to journal. False if it cannot.
+    bool retract(uint64_t seq) {
+        lock_guard<mutex> lk(m_mutex);
+        if (!m_retractable || seq != m_seq) return false;
+        if (::ftruncate(m_fd, static_cast<off_t>(m_lastAt)) != 0) return false;
+        m_size = m_lastAt;
+        m_retractable = false;
+        m_dirty = true;
+        --m_pending;
+        --m_seq;
+        return true;
+    }
+
+    // Forces everything appended so far to disk.
+    void sync() {
+        lock_guard<mutex> lk(m_mutex);
+        ::fdatasync(m_fd);
+        m_dirty = false;
+    }
+
+    // Drops all records; called once a snapshot covering them is durable.
+    void reset() {
+        lock_guard<mutex> lk(m_mutex);
+        if (::ftruncate(m_fd, 0) != 0) throw runtime_error("Failed to truncate journal.");
+        ::fdatasync(m_fd);
+        m_dirty = false;
+        m_pending = 0;
+        m_size = 0;
+        m_retractable = false;
+    }
+
+    uint64_t lastSeq() const { return m_seq; }
+    size_t pending() const { return m_pending; }
+    const string& path() const { return m_path; }
+
+    template <class Fn>
+    static void replay(const string& path, Fn&& fn) {
+        MappedFile f(path);
+        scan(f, fn);
+    }
+};
+
+// Price-time priority limit order book for one security. Each price level is
+// an intrusive FIFO of orders threaded by index through a preallocated pool,
+// so add, cancel and match allocate nothing once the pool and the level maps
+// are warm. Cancel unlinks in O(1) and leaves an emptied level in its map
+// for matching (or the next order at that price) to pick up.
+class OrderBook {
+public:
+    using OrderId = uint64_t;  // generation << 32 | pool slot; 0 is never issued
+    using Owner = uint32_t;
+    enum class Side : uint8_t { Buy, Sell };
+
+    struct Order {
+        Owner owner;
+        Side side;
+        Money price;
+        long long quantity;  // still open
+    };
+
+    // One match: the resting (maker) order trades at its own price.
+    struct Fill {
+        OrderId maker, taker;
+        Owner makerOwner, takerOwner;
+        Side takerSide;
+        Money price;
+        long long quantity;
+    };
+
+private:
+    static constexpr uint32_t kNil = numeric_limits<uint32_t>::max();
+
+    struct Level {
+        long long quantity = 0;
+        uint32_t head = kNil, tail = kNil;
+    };
+
+    struct Slot {
+        Order order;
+        uint32_t gen = 1;
+        uint32_t prev = kNil, next = kNil;  // level FIFO links; next also chains free slots
+        Level* level = nullptr;             // set while resting
+    };
+
+    template <class Cmp> using Levels = pmr::map<int64_t, Level, Cmp>;
+
+    vector<Slot> m_slots;
+    uint32_t m_free = kNil;
+    size_t m_resting = 0;
+    pmr::unsynchronized_pool_resource m_pool;
+    Levels<greater<int64_t>> m_bids{&m_pool};  // best first
+    Levels<less<int64_t>> m_asks{&m_pool};
+
+    OrderId idOf(uint32_t s) const { return uint64_t{m_slots[s].gen} << 32 | s; }
+
+    // The slot behind a resting order, or kNil.
+    uint32_t slotOf(OrderId id) const {
+        uint32_t s = static_cast<uint32_t>(id);
+        if (s >= m_slots.size() || m_slots[s].gen != id >> 32 || !m_slots[s].level) return kNil;
+        return s;
+    }
+
+    uint32_t allocate() {
+        if (m_free == kNil) {
+            m_slots.emplace_back();
+            return static_cast<uint32_t>(m_slots.size() - 1);
+        }
+        uint32_t s = m_free;
+        m_free = m_slots[s].next;
+        return s;
+    }
+
+    void release(uint32_t s) {
+        Slot& sl = m_slots[s];
+        sl.level = nullptr;
+        if (++sl.gen == 0) sl.gen = 1;
+        sl.next = m_free;
+        m_free = s;
+    }
+
+    void link(uint32_t s, Level& lv) {
+        Slot& sl = m_slots[s];
+        sl.level = &lv;
+        sl.prev = lv.tail;
+        sl.next = kNil;
+        (lv.tail == kNil ? lv.head : m_slots[lv.tail].next) = s;
+        lv.tail = s;
+        lv.quantity += sl.order.quantity;
+        ++m_resting;
+    }
+
+    void unlink(uint32_t s) {
+        Slot& sl = m_slots[s];
+        Level& lv = *sl.level;
+        (sl.prev == kNil ? lv.head : m_slots[sl.prev].next) = sl.next;
+        (sl.next == kNil ? lv.tail : m_slots[sl.next].prev) = sl.prev;
+        lv.quantity -= sl.order.quantity;
+        --m_resting;
+    }
+
+    // Fills taker slot t against book while its best level crosses limit;
+    // returns the quantity left.
+    template <class Book, class OnFill>
+    long long match(Book& book, uint32_t t, int64_t limit, OnFill& onFill) {
+        const Order taker = m_slots[t].order;
+        long long qty = taker.quantity;
+        while (qty > 0 && !book.empty()) {
+            auto top = book.begin();
+            Level& lv = top->second;
+            if (lv.head == kNil) { book.erase(top); continue; }
+            if (book.key_comp()(limit, top->first)) break;
+            while (qty > 0 && lv.head != kNil) {
+                uint32_t s = lv.head;
+                Order& maker = m_slots[s].order;
+                long long q = min(qty, maker.quantity);
+                // onFill runs first so a throw leaves this maker untouched.
+                const Fill f{idOf(s), idOf(t), maker.owner, taker.owner, taker.side, maker.price, q};
+                onFill(f);
+                qty -= q;
+                if (q == maker.quantity) {
+                    unlink(s);
+                    release(s);
+                } else {
+                    maker.quantity -= q;
+                    lv.quantity -= q;
+                }
+            }
+        }
+        return qty;
+    }
+
+    template <class Book>
+    static Money best(const Book& book) {
+        for (auto& kv : book)
+            if (kv.second.head != kNil) return Money::fromUnits(kv.first);
+        return Money();
+    }
+
+public:
+    explicit OrderBook(size_t capacity = 1024) : m_slots(capacity) {
+        for (size_t i = capacity; i-- > 0;) {
+            m_slots[i].next = m_free;
+            m_free = static_cast<uint32_t>(i);
+        }
+    }
+
+    OrderBook(const OrderBook&) = delete;
+    OrderBook& operator=(const OrderBook&) = delete;
+
+    // Matches a limit order against the other side, calling onFill(const
+    // Fill&) for each trade, then rests what is left unless rest is false.
+    // Returns the resting order's id, or 0 if nothing rests. onFill must not
+    // call back into the book; if it throws, the fills before it stand, the
+    // maker it was called for is unchanged and nothing rests.
+    template <class OnFill>
+    OrderId add(Owner owner, Side side, Money price, long long qty, OnFill&& onFill, bool rest = true) {
+        if (qty <= 0) throw runtime_error("Quantity must be positive.");
+        if (price <= Money()) throw runtime_error("Price must be positive.");
+        uint32_t t = allocate();
+        m_slots[t].order = Order{owner, side, price, qty};
+        long long left;
+        try {
+            left = side == Side::Buy ? match(m_asks, t, price.units(), onFill)
+                                     : match(m_bids, t, price.units(), onFill);
+        } catch (...) {
+            release(t);
+            throw;
+        }
+        if (left == 0 || !rest) { release(t); return 0; }
+        m_slots[t].order.quantity = left;
+        link(t, side == Side::Buy ? m_bids[price.units()] : m_asks[price.units()]);
+        return idOf(t);
+    }
+
+    // False if id is not resting here (filled, cancelled or never issued).
+    bool cancel(OrderId id) {
+        uint32_t s = slotOf(id);
+        if (s == kNil) return false;
+        unlink(s);
+        release(s);
+        return true;
+    }
+
+    // The resting order behind id, or nullptr.
+    const Order* order(OrderId id) const {
+        uint32_t s = slotOf(id);
+        return s == kNil ? nullptr : &m_slots[s].order;
+    }
+
+    // Zero when that side is empty.
+    Money bestBid() const { return best(m_bids); }
+    Money bestAsk() const { return best(m_asks); }
+
+    long long depth(Side side, Money price) const {
+        if (side == Side::Buy) { auto it = m_bids.find(price.units()); return it == m_bids.end() ? 0 : it->second.quantity; }
+        auto it = m_asks.find(price.units());
+        return it == m_asks.end() ? 0 : it->second.quantity;
+    }
+
+    size_t size() const { return m_resting; }
+};
+
+class User {
+    string m_name;
+    Money m_balance;
+    Money m_realizedPnL;
+    Portfolio m_portfolio;
+    Journal* m_journal = nullptr;
+    string m_snapshotFile;       // compaction target for the journal
+    uint64_t m_journalSeq = 0;   // last journal record reflected in this state
+    Money m_reservedCash;        // held back for resting Exchange orders
+    unordered_map<SecId, long long> m_reservedShares;
+
+    struct Settled { Money balance, realizedPnL; };
+
+    // The balance and realized P&L after a trade, computed without changing
+    // anything; throws if the trade cannot be applied. Once these pass,
+    // applyBuy/applySell cannot fail.
+    Settled checkBuy(SecId id, long long qty, Money price) const {
+        Money cost = price * qty;
+        m_portfolio.checkAdd(id, qty, cost);
+        return Settled{m_balance - cost, m_realizedPnL};
+    }
+
+    Settled checkSell(SecId id, long long qty, Money price) const {
+        Money profit = price * qty - m_portfolio.saleBasis(id, qty);
+        return Settled{m_balance + price * qty, m_realizedPnL + profit};
+    }
+
+    void applyBuy(SecId id, long long qty, Money price) {
+        Settled s = checkBuy(id, qty, price);
+        m_portfolio.buy(id, qty, price);
+        m_balance = s.balance;
+    }
+
+    void applySell(SecId id, long long qty, Money price) {
+        Settled s = checkSell(id, qty, price);
+        m_portfolio.sell(id, qty, price);
+        m_balance = s.balance;
+        m_realizedPnL = s.realizedPnL;
+    }
+
+    // Returns the record's seq, or 0 without a journal.
+    uint64_t record(Journal::Op op, string_view sym, long long qty, Money value) {
+        return m_journal ? m_journal->append(op, sym, qty, value) : 0;
+    }
+
+    void journal(Journal::Op op, string_view sym, long long qty, Money value) {
+        if (m_journal) m_journalSeq = record(op, sym, qty, value);
+    }
+
+public:
+    explicit User(string name) : m_name(std::move(name)) {}
+
+    const string& name() const { return m_name; }
+    Money balance() const { return m_balance; }
+    Money realizedPnL() const { return m_realizedPnL; }
+    const Portfolio& portfolio() const { return m_portfolio; }
+    Portfolio& portfolio() { return m_portfolio; }
+
+    void addFunds(Money amount) {
+        if (amount <= Money()) throw runtime_error("Amount must be positive.");
+        journal(Journal::Op::AddFunds, "", 0, amount);
+        m_balance += amount;
+    }
+
+    // Every later buy/sell/addFunds is journaled before it is applied; after
+    // Journal::kCompactEvery records the state is snapshotted to snapshotFile
+    // and the journal truncated.
+    void attachJournal(Journal* j, string snapshotFile) {
+        m_journal = j;
+        m_snapshotFile = std::move(snapshotFile);
+    }
+
+    uint64_t journalSeq() const { return m_journalSeq; }
+
+    // Re-applies journal records newer than the loaded snapshot.
+    void replay(const string& journalFile, Market& mkt) {
+        m_portfolio.bind(mkt);
+        Journal::replay(journalFile, [&](const Journal::Entry& e) {
+            if (e.seq <= m_journalSeq) return;
+            m_journalSeq = e.seq;
+            if (e.op == Journal::Op::AddFunds) { m_balance += e.value; return; }
+            SecId id = mkt.find(e.symbol);
+            if (id == Market::npos) return;
+            if (e.op == Journal::Op::Buy) applyBuy(id, e.quantity, e.value);
+            else if (e.op == Journal::Op::Sell && m_portfolio.has(id)) applySell(id, e.quantity, e.value);
+        });
+    }
+
+    // Folds the journal into a fresh snapshot, then truncates it.
+    void compact(const Market& mkt) {
+        if (!m_journal) return;
+        m_journalSeq = m_journal->lastSeq();
+        saveSnapshot(m_snapshotFile, mkt);
+        m_journal->reset();
+    }
+
+    // buy/sell return the fill price.
+    // Fills at the market price rounded to Money.
+    Money buy(Market& mkt, const string& sym, long long qty) { return buy(mkt, resolve(mkt, sym), qty); }
+    Money sell(Market& mkt, const string& sym, long long qty) { return sell(mkt, resolve(mkt, sym), qty); }
+
+    Money buy(Market& mkt, SecId id, long long qty) {
+        Money price = Money::fromDouble(mkt.price(id));
+        settleBuy(mkt, id, qty, price);
+        mkt.trade(id, qty);
+        return price;
+    }
+
+    Money sell(Market& mkt, SecId id, long long qty) {
+        Money price = Money::fromDouble(mkt.price(id));
+        settleSell(mkt, id, qty, price);
+        mkt.trade(id, qty);
+        return price;
+    }
+
+    // A trade at a given price, e.g. one matched on an Exchange; checked,
+    // journaled and applied like buy/sell. Everything that can throw is
+    // checked before the journal record is written.
+    void settleBuy(Market& mkt, SecId id, long long qty, Money price) {
+        commitBuy(id, qty, price, stageBuy(mkt, id, qty, price, Money()));
+        compactIfDue(mkt);
+    }
+
+    void settleSell(Market& mkt, SecId id, long long qty, Money price) {
+        commitSell(id, qty, price, stageSell(mkt, id, qty, price, 0));
+        compactIfDue(mkt);
+    }
+
+    // settleBuy/settleSell in steps, for a trade that must land on both sides
+    // or neither. stage* checks the trade, counting `reserved` of this user's
+    // own reservation as spendable, and journals it; it returns the record's
+    // seq (0 without a journal), which unstage retracts. commit* applies a
+    // staged trade and cannot fail. compactIfDue snapshots if the journal is due.
+    uint64_t stageBuy(Market& mkt, SecId id, long long qty, Money price, Money reserved) {
+        if (qty <= 0) throw runtime_error("Quantity must be positive.");
+        m_portfolio.bind(mkt);
+        if (price * qty > available() + reserved) throw runtime_error("Insufficient balance.");
+        checkBuy(id, qty, price);
+        return record(Journal::Op::Buy, mkt.symbol(id), qty, price);
+    }
+
+    uint64_t stageSell(Market& mkt, SecId id, long long qty, Money price, long long reserved) {
+        if (qty <= 0) throw runtime_error("Quantity must be positive.");
+        m_portfolio.bind(mkt);
+        if (availableShares(id) + reserved < qty) throw runtime_error("Not enough shares to sell.");
+        checkSell(id, qty, price);
+        return record(Journal::Op::Sell, mkt.symbol(id), qty, price);
+    }
+
+    void unstage(uint64_t seq) {
+        if (m_journal && seq) m_journal->retract(seq);
+    }
+
+    void commitBuy(SecId id, long long qty, Money price, uint64_t seq) {
+        applyBuy(id, qty, price);
+        if (seq) m_journalSeq = seq;
+    }
+
+    void commitSell(SecId id, long long qty, Money price, uint64_t seq) {
+        applySell(id, qty, price);
+        if (seq) m_journalSeq = seq;
+    }
+
+    void compactIfDue(const Market& mkt) {
+        if (m_journal && m_journal->pending() >= Journal::kCompactEvery) compact(mkt);
+    }
+
+    long long held(SecId id) const {
+        auto it = m_portfolio.all().find(id);
+        return it == m_portfolio.all().end() ? 0 : it->second.quantity;
+    }
+
+    // Cash and shares reserved for resting orders are binding: buy/sell and
+    // settleBuy/settleSell only spend what is left over.
+    Money reservedCash() const { return m_reservedCash; }
+    long long reservedShares(SecId id) const {
+        auto it = m_reservedShares.find(id);
+        return it == m_reservedShares.end() ? 0 : it->second;
+    }
+    Money available() const { return m_balance - m_reservedCash; }
+    long long availableShares(SecId id) const { return held(id) - reservedShares(id); }
+
+    void reserveCash(Money amount) {
+        if (amount > available()) throw runtime_error("Insufficient balance.");
+        m_reservedCash += amount;
+    }
+
+    void reserveShares(SecId id, long long qty) {
+        if (availableShares(id) < qty) throw runtime_error("Not enough shares to sell.");
+        m_reservedShares[id] += qty;
+    }
+
+    void releaseCash(Money amount) { m_reservedCash -= amount; }
+
+    void releaseShares(SecId id, long long qty) {
+        auto it = m_reservedShares.find(id);
+        if ((it->second -= qty) == 0) m_reservedShares.erase(it);
+    }
+
+    static SecId resolve(const Market& mkt, const string& sym) {
+        SecId id = mkt.find(sym);
+        if (id == Market::npos) throw runtime_error("Symbol not found.");
+        return id;
+    }
+
+    Money totalEquity(const Market& mkt) const {
+        return m_balance + m_portfolio.marketValue(mkt);
+    }
+
+    // Persistence. The text format (save/load) is the import/export path;
+    // the binary snapshot is what the app uses day to day.
+    void saveSnapshot(const string& filename, const Market& mkt) const {
+        const auto& hs = m_portfolio.all();
+        snapshot::Header hdr{};
+        memcpy(hdr.magic, snapshot::kMagic, sizeof hdr.magic);
+        hdr.version = snapshot::kVersion;
+        hdr.headerSize = sizeof hdr;
+        hdr.balance = m_balance.units();
+        hdr.realizedPnL = m_realizedPnL.units();
+        hdr.holdingCount = hs.size();
+        hdr.journalSeq = m_journalSeq;
+
+        string buf(sizeof hdr + hs.size() * sizeof(snapshot::Record), '\0'), strings;
+        size_t rec = sizeof hdr;
+        for (auto& kv : hs) {
+            string_view sym = mkt.symbol(kv.first);
+            snapshot::Record r{static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(sym.size()),
+                               kv.second.quantity, kv.second.cost.units()};
+            memcpy(&buf[rec], &r, sizeof r);
+            rec += sizeof r;
+            strings += sym;
+        }
+        buf += strings;
+        hdr.stringsSize = strings.size();
+        hdr.checksum = util::checksum(buf.data() + sizeof hdr, buf.size() - sizeof hdr);
+        memcpy(&buf[0], &hdr, sizeof hdr);
+
+        string tmp = filename + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw runtime_error("Failed to open save file.");
+        bool ok = util::writeAll(fd, buf.data(), buf.size());
+        ok = ::fsync(fd) == 0 && ok;
+        ok = ::close(fd) == 0 && ok;
+        if (!ok || ::rename(tmp.c_str(), filename.c_str()) != 0) {
+            ::unlink(tmp.c_str());
+            throw runtime_error("Failed to write save file.");
         }
-        out.push_back(trim(cur));
-        return out;
+        // compact() truncates the journal next; the rename must be on disk first.
+        if (!util::syncDir(filename)) throw runtime_error("Failed to write save file.");
     }
 
-    inline string toMoney(double v) {
-        stringstream ss;
-        ss.setf(std::ios::fixed); ss << setprecision(2) << v;
-        return ss.str();
+    // Returns false if there is no snapshot; throws if it is corrupt.
+    bool loadSnapshot(const string& filename, Market& mkt) {
+        MappedFile f(filename);
+        if (!f) return false;
+        snapshot::Header hdr{};
+        if (f.size() < snapshot::kHeaderSizeV1) throw runtime_error("Snapshot truncated.");
+        memcpy(&hdr, f.data(), snapshot::kHeaderSizeV1);
+        if (memcmp(hdr.magic, snapshot::kMagic, sizeof hdr.magic) != 0) throw runtime_error("Not a portfolio snapshot.");
+        if (hdr.version < 1 || hdr.version > snapshot::kVersion) throw runtime_error("Unsupported snapshot version.");
+        const size_t hdrSize = hdr.version == 1 ? snapshot::kHeaderSizeV1 : sizeof hdr;
+        if (hdr.headerSize != hdrSize || f.size() < hdrSize) throw runtime_error("Snapshot truncated.");
+        memcpy(&hdr, f.data(), hdrSize);
+        const uint64_t recBytes = hdr.holdingCount * sizeof(snapshot::Record);
+        if (hdr.holdingCount > f.size() / sizeof(snapshot::Record) || f.size() != hdrSize + recBytes + hdr.stringsSize)
+            throw runtime_error("Snapshot truncated.");
+        if (util::checksum(f.data() + hdrSize, f.size() - hdrSize) != hdr.checksum)
+            throw runtime_error("Snapshot checksum mismatch.");
+
+        // v1/v2 amounts are doubles in the same slots.
+        const bool legacy = hdr.version < 3;
+        auto amount = [legacy](int64_t raw) {
+            if (!legacy) return Money::fromUnits(raw);
+            double d;
+            memcpy(&d, &raw, sizeof d);
+            return Money::fromDouble(d);
+        };
+        Money balance = amount(hdr.balance), realized = amount(hdr.realizedPnL);
+        m_balance = balance; m_realizedPnL = realized;
+        m_journalSeq = hdr.journalSeq;
+        m_portfolio.clear();
+        m_portfolio.bind(mkt);
+        m_portfolio.reserve(hdr.holdingCount);
+        const char* recs = f.data() + hdrSize;
+        const char* strings = recs + recBytes;
+        string sym;
+        for (uint64_t i = 0; i < hdr.holdingCount; ++i) {
+            snapshot::Record r;
+            memcpy(&r, recs + i * sizeof r, sizeof r);
+            if (uint64_t{r.symOffset} + r.symLength > hdr.stringsSize) throw runtime_error("Snapshot corrupt.");
+            sym.assign(strings + r.symOffset, r.symLength);
+            SecId id = mkt.find(sym);
+            if (id == Market::npos || r.quantity <= 0) continue;
+            if (legacy) m_portfolio.buy(id, r.quantity, amount(r.cost));  // avgCost
+            else m_portfolio.add(id, r.quantity, Money::fromUnits(r.cost));
+        }
+        return true;
     }
-}
 
-class Security {
-public:
-    virtual ~Security() = default;
-    virtual string symbol() const = 0;
-    virtual string name() const = 0;
-    virtual double price() const = 0;
-    virtual void updatePrice(std::mt19937& rng) = 0; // polymorphic
+    // Text format: "balance realizedPnL", the holding count, then one
+    // "symbol,quantity,avgCost,cost" line per holding, amounts written with
+    // all four decimals. cost is the exact basis; files without it (three
+    // columns) are read as avgCost * quantity.
+    void save(const string& filename, const Market& mkt) const {
+        ofstream out(filename);
+        if (!out) throw runtime_error("Failed to open save file.");
+        char buf[util::kMoneyChars];
+        auto text = [&buf](Money m) {
+            return string_view(buf, static_cast<size_t>(m.format(buf, buf + sizeof buf, Money::kDecimals) - buf));
+        };
+
+        out << text(m_balance) << " ";
+        out << text(m_realizedPnL) << "\n";
+        const auto& h = m_portfolio.all();
+        out << h.size() << "\n";
+        for (auto& kv : h) {
+            out << mkt.symbol(kv.first) << ","
+                << kv.second.quantity << ",";
+            out << text(kv.second.avgCost()) << ",";
+            out << text(kv.second.cost) << "\n";
+        }
+    }
+
+    // Holdings in symbols the market does not list are dropped.
+    void load(const string& filename, Market& mkt) {
+        MappedFile file(filename);
+        if (!file) return;
+        util::CsvReader csv(file.data(), file.size());
+        if (!csv.next() || csv.size() != 1) return;
+        Money bal, rp;
+        {
+            string_view s = csv[0];
+            size_t sp = s.find_first_of(" \t");
+            if (sp == string_view::npos) return;
+            size_t r = s.find_first_not_of(" \t", sp);
+            if (r == string_view::npos) return;
+            if (!Money::parse(s.substr(0, sp), bal) || !Money::parse(s.substr(r), rp)) return;
+        }
+        m_balance = bal; m_realizedPnL = rp;
+        if (!csv.next()) return;
+        size_t n = 0;
+        from_chars(csv[0].data(), csv[0].data() + csv[0].size(), n);
+        m_portfolio.clear();
+        m_portfolio.bind(mkt);
+        string sym;
+        for (size_t i = 0; i < n && csv.next(); ++i) {
+            if (csv.size() != 3 && csv.size() != 4) continue;
+            sym.assign(csv[0].data(), csv[0].size());
+            SecId id = mkt.find(sym);
+            if (id == Market::npos) continue;
+            long long qty = 0;
+            Money avgCost, cost;
+            string_view q = csv[1];
+            auto r = from_chars(q.data(), q.data() + q.size(), qty);
+            if (r.ec != errc() || r.ptr != q.data() + q.size() || qty <= 0) continue;
+            if (!Money::parse(csv[2], avgCost)) continue;
+            if (csv.size() == 4) {
+                if (!Money::parse(csv[3], cost)) continue;
+                m_portfolio.add(id, qty, cost);
+            } else {
+                m_portfolio.buy(id, qty, avgCost);
+            }
+        }
+    }
 };
 
-class Stock : public Security {
-    string m_symbol;
-    string m_name;
-    double m_price;
-    double m_baseVol; 
+// Monte Carlo value at risk for a portfolio. Simulates `paths` futures of
+// the market model over `horizon` ticks for every holding, straight from the
+// Market columns (no Security is cloned), and reads VaR and expected
+// shortfall off the distribution of losses against today's value.
+//
+// Paths run in blocks of simd::kBlock across the pool, and a block carries
+// each holding through the whole horizon while its prices sit in L1. The
+// normals for (holding, tick, block) come from their own Philox counter, so
+// a report depends only on the seed, never on the pool size.
+class RiskEngine {
 public:
-    Stock(string sym, string nm, double p, double vol)
-        : m_symbol(std::move(sym)), m_name(std::move(nm)), m_price(p), m_baseVol(vol) {}
+    struct Options {
+        size_t paths = 100000;
+        int horizon = 1;  // ticks
+        uint64_t seed = 1;
+    };
 
-    string symbol() const override { return m_symbol; }
-    string name()   const override { return m_name; }
-    double price()  const override { return m_price; }
+    struct Level {
+        double confidence;
+        Money var;  // the loss at the confidence quantile
+        Money es;   // mean loss at or beyond var
+    };
 
-    void updatePrice(std::mt19937& rng) override {
-        std::normal_distribution<double> noise(0.0, m_baseVol);
-        double drift = 0.0005;  // tiny positive drift
-        double change = drift + noise(rng);
-        double np = m_price * (1.0 + change);
-        // Clamp to a reasonable range to avoid going to zero or exploding
-        np = max(1.0, min(np, m_price * 1.25));
-        m_price = np;
+    struct Report {
+        Money value;  // today's market value
+        size_t paths;
+        int horizon;
+        vector<Level> levels;
+    };
+
+private:
+    struct Position {
+        double quantity, price, drift, vol;
+    };
+
+    const Market& m_market;
+    ThreadPool& m_pool;
+
+public:
+    RiskEngine(const Market& market, ThreadPool& pool) : m_market(market), m_pool(pool) {}
+
+    Report run(const Portfolio& pf, const vector<double>& confidence, const Options& opt) const {
+        if (opt.paths == 0 || opt.horizon < 1) throw runtime_error("Risk needs at least one path and one tick.");
+        for (double c : confidence)
+            if (!(c > 0.0 && c < 1.0)) throw runtime_error("Confidence must be between 0 and 1.");
+
+        // Holdings in id order, so the sums do not depend on hash order.
+        vector<pair<SecId, long long>> held;
+        for (auto& kv : pf.all()) held.emplace_back(kv.first, kv.second.quantity);
+        sort(held.begin(), held.end());
+        vector<Position> pos;
+        Report r{Money(), opt.paths, opt.horizon, {}};
+        double value = 0.0;
+        {
+            PriceView view = m_market.snapshot();
+            for (auto& [id, qty] : held) {
+                pos.push_back(Position{static_cast<double>(qty), view[id], m_market.drift(id), m_market.volatility(id)});
+                r.value += Money::fromDouble(view[id]) * qty;
+                value += static_cast<double>(qty) * view[id];
+            }
+        }
+
+        const simd::Kernels& k = simd::kernels();
+        const size_t blocks = (opt.paths + simd::kBlock - 1) / simd::kBlock;
+        vector<double> loss(opt.paths);
+        m_pool.run(blocks, [&](size_t b) {
+            const size_t first = b * simd::kBlock, len = min(simd::kBlock, opt.paths - first);
+            double px[simd::kBlock], drift[simd::kBlock], vol[simd::kBlock], z[simd::kBlock + 1];
+            double sum[simd::kBlock] = {};
+            for (size_t h = 0; h < pos.size(); ++h) {
+                const Position& p = pos[h];
+                fill_n(px, len, p.price);
+                fill_n(drift, len, p.drift);
+                fill_n(vol, len, p.vol);
+                for (int t = 0; t < opt.horizon; ++t) {
+                    simd::philoxNormals(k, opt.seed, uint64_t{h} << 32 | static_cast<uint32_t>(t), b, z, len);
+                    k.gbm(px, drift, vol, z, len);
+                }
+                for (size_t j = 0; j < len; ++j) sum[j] += p.quantity * px[j];
+            }
+            for (size_t j = 0; j < len; ++j) loss[first + j] = value - sum[j];
+        });
+
+        sort(loss.begin(), loss.end());
+        for (double c : confidence) {
+            size_t i = min(opt.paths - 1, static_cast<size_t>(c * static_cast<double>(opt.paths)));
+            double tail = accumulate(loss.begin() + static_cast<ptrdiff_t>(i), loss.end(), 0.0);
+            r.levels.push_back(Level{c, Money::fromDouble(loss[i]),
+                                     Money::fromDouble(tail / static_cast<double>(opt.paths - i))});
+        }
+        return r;
     }
 };
 
-class Market {
-    unordered_map<string, unique_ptr<Security>> m_securities;
+// Limit-order trading between Users: an OrderBook per security, with every
+// fill settled into both sides' cash and Portfolio (and journals) at the
+// maker's price. Cash for buys and shares for sells are reserved on the User
+// when the order is placed, and the User's own buy/sell cannot spend them,
+// so a crossing order always finds both sides able to settle.
+class Exchange {
 public:
-    Market() = default;
+    using OrderId = OrderBook::OrderId;
+    using Owner = OrderBook::Owner;
+    using Side = OrderBook::Side;
+    using Fill = OrderBook::Fill;
 
-    void addSecurity(unique_ptr<Security> sec) {
-        string sym = sec->symbol();
-        m_securities.emplace(sym, std::move(sec));
+private:
+    Market& m_market;
+    size_t m_ordersPerBook;
+    vector<User*> m_users;                     // by Owner
+    vector<unique_ptr<OrderBook>> m_books;     // by SecId, made on first use
+    vector<Fill> m_fills;                      // from the last place()
+
+    User& user(Owner o) {
+        if (o >= m_users.size()) throw runtime_error("Unknown trader.");
+        return *m_users[o];
     }
 
-    Security* get(const string& symbol) {
-        auto it = m_securities.find(symbol);
-        if (it == m_securities.end()) return nullptr;
-        return it->second.get();
+    // Both sides are checked and journaled before either changes (the
+    // seller's record is retracted if the buyer's fails), and applying them
+    // cannot fail, so a fill that cannot settle throws with nothing moved.
+    // Snapshots the journals fall due for are left to place().
+    void settle(SecId id, const Fill& f, Money takerLimit) {
+        bool takerBuys = f.takerSide == Side::Buy;
+        User& buyer = *m_users[takerBuys ? f.takerOwner : f.makerOwner];
+        User& seller = *m_users[takerBuys ? f.makerOwner : f.takerOwner];
+        Money reserved = (takerBuys ? takerLimit : f.price) * f.quantity;
+        if (buyer.reservedCash() < reserved || seller.reservedShares(id) < f.quantity)
+            throw runtime_error("Exchange reservations are out of sync.");
+        uint64_t sold = seller.stageSell(m_market, id, f.quantity, f.price, f.quantity);
+        uint64_t bought;
+        try {
+            bought = buyer.stageBuy(m_market, id, f.quantity, f.price, reserved);
+        } catch (...) {
+            seller.unstage(sold);
+            throw;
+        }
+        buyer.releaseCash(reserved);
+        seller.releaseShares(id, f.quantity);
+        seller.commitSell(id, f.quantity, f.price, sold);
+        buyer.commitBuy(id, f.quantity, f.price, bought);
+        m_market.trade(id, f.quantity);
+        m_fills.push_back(f);
     }
 
-    const Security* get(const string& symbol) const {
-        auto it = m_securities.find(symbol);
-        if (it == m_securities.end()) return nullptr;
-        return it->second.get();
+public:
+    explicit Exchange(Market& market, size_t ordersPerBook = 1024)
+        : m_market(market), m_ordersPerBook(ordersPerBook) {}
+
+    Owner join(User& u) {
+        m_users.push_back(&u);
+        return static_cast<Owner>(m_users.size() - 1);
     }
 
-    const unordered_map<string, unique_ptr<Security>>& all() const {
-        return m_securities;
+    OrderBook& book(SecId id) {
+        if (id >= m_market.size()) throw runtime_error("Symbol not found.");
+        if (m_books.size() <= id) m_books.resize(m_market.size());
+        if (!m_books[id]) m_books[id] = make_unique<OrderBook>(m_ordersPerBook);
+        return *m_books[id];
     }
 
-    void tick(std::mt19937& rng, int times = 1) {
-        for (int t = 0; t < times; ++t) {
-            for (auto& kv : m_securities) kv.second->updatePrice(rng);
+    // Places a limit order; the trades it made are in fills(). Returns the
+    // resting order's id, or 0 if nothing rests (filled, or rest is false).
+    // If a fill throws, the fills before it stand and the rest of the order
+    // is dropped with its reservation. Snapshots due after the fills are
+    // taken last; if one fails it throws, but the order and its fills stand
+    // and the journals still hold them.
+    OrderId place(Owner o, SecId id, Side side, long long qty, Money limit, bool rest = true) {
+        User& u = user(o);
+        OrderBook& b = book(id);
+        if (qty <= 0) throw runtime_error("Quantity must be positive.");
+        if (limit <= Money()) throw runtime_error("Price must be positive.");
+        if (side == Side::Buy) u.reserveCash(limit * qty);
+        else u.reserveShares(id, qty);
+        m_fills.clear();
+        auto releaseRest = [&] {
+            long long left = qty;
+            for (const Fill& f : m_fills) left -= f.quantity;
+            if (left == 0) return;
+            if (side == Side::Buy) u.releaseCash(limit * left);
+            else u.releaseShares(id, left);
+        };
+        OrderId rid;
+        try {
+            rid = b.add(o, side, limit, qty, [&](const Fill& f) { settle(id, f, limit); }, rest);
+        } catch (...) {
+            releaseRest();
+            throw;
         }
+        if (rid == 0) releaseRest();
+        for (const Fill& f : m_fills) m_users[f.makerOwner]->compactIfDue(m_market);
+        u.compactIfDue(m_market);
+        return rid;
     }
 
-    void list() const {
-        cout << "\n--- Market ---\n";
-        cout << left << setw(8) << "Symbol" << setw(24) << "Name" << right << setw(12) << "Price\n";
-        cout << string(46, '-') << "\n";
-        vector<const Security*> v;
-        v.reserve(m_securities.size());
-        for (auto& kv : m_securities) v.push_back(kv.second.get());
-        sort(v.begin(), v.end(), [](auto* a, auto* b){ return a->symbol() < b->symbol(); });
-        for (auto* s : v) {
-            cout << left << setw(8) << s->symbol()
-                 << setw(24) << s->name()
-                 << right << setw(12) << util::toMoney(s->price()) << "\n";
-        }
+    // Cancels one of o's resting orders on id; false if there is none.
+    bool cancel(Owner o, SecId id, OrderId oid) {
+        User& u = user(o);
+        OrderBook& b = book(id);
+        const OrderBook::Order* ord = b.order(oid);
+        if (!ord || ord->owner != o) return false;
+        if (ord->side == Side::Buy) u.releaseCash(ord->price * ord->quantity);
+        else u.releaseShares(id, ord->quantity);
+        return b.cancel(oid);
     }
+
+    const vector<Fill>& fills() const { return m_fills; }
 };
 
+// Resting limit, stop and stop-limit orders, checked against each new price
+// after Market::tick. Every security with pending orders keeps two max-heaps:
+// one of orders that fire when the price falls to their key (buy limits,
+// sell stops) and one, with keys negated, of orders that fire when it rises
+// to theirs (sell limits, buy stops). A tick then costs O(log n) per fired
+// order plus a peek per watched security. Cancel only marks the order dead;
+// its heap entry is skipped when it surfaces, and a heap is rebuilt once
+// dead entries outnumber live ones. Fired orders queue until take(), which
+// the owner calls after every tick so they fill at the price that fired them.
+class TriggerBook : public PriceListener {
+public:
+    using OrderId = uint64_t;  // generation << 32 | slot; 0 is never issued
+    enum class Side : uint8_t { Buy, Sell };
+    enum class Type : uint8_t { Limit, Stop, StopLimit };
 
-struct Holding {
-    string symbol;
-    long long quantity = 0;
-    double avgCost = 0.0;
-};
+    struct Order {
+        uint32_t owner;
+        SecId security;
+        Side side;
+        Type type;
+        long long quantity;
+        Money stop;   // Stop and StopLimit
+        Money limit;  // Limit and StopLimit
+    };
 
-class Portfolio {
-    unordered_map<string, Holding> m_holdings;
+    // A fired order; a stop-limit fires as a Limit once its stop is hit.
+    struct Fired {
+        OrderId id;
+        Order order;
+        Money price;  // the price that fired it
+    };
 
-public:
-    bool has(const string& sym) const {
-        return m_holdings.find(sym) != m_holdings.end();
+private:
+    enum Heap { kFalls, kRises };
+
+    struct Entry {
+        int64_t key;    // price units, negated in kRises
+        uint64_t seq;   // placement order breaks ties
+        uint32_t slot, gen;
+        bool operator<(const Entry& o) const { return key != o.key ? key < o.key : seq > o.seq; }
+    };
+
+    struct Book {
+        vector<Entry> heap[2];
+        uint32_t live = 0, dead = 0;
+        bool watched = false;
+    };
+
+    struct Slot {
+        Order order;
+        uint64_t seq;
+        uint32_t gen = 1;
+        uint32_t next;  // free list
+        bool live = false;
+    };
+
+    static constexpr uint32_t kNil = numeric_limits<uint32_t>::max();
+
+    Market& m_market;
+    mutex m_update;    // serializes place/cancel/take, which may (un)watch
+    mutable SpinLock m_lock;  // guards the state onPrice touches
+    vector<Book> m_books;     // by SecId
+    vector<Slot> m_slots;
+    uint32_t m_free = kNil;
+    uint64_t m_seq = 0;
+    size_t m_live = 0;
+    vector<Fired> m_fired;
+    vector<SecId> m_drained;  // emptied by onPrice, to unwatch in take()
+
+    OrderId idOf(uint32_t s) const { return uint64_t{m_slots[s].gen} << 32 | s; }
+
+    static Heap heapOf(const Order& o, bool stop) {
+        return (o.side == Side::Buy) != stop ? kFalls : kRises;
     }
 
-    const unordered_map<string, Holding>& all() const { return m_holdings; }
+    void push(Book& b, uint32_t s, bool stop) {
+        const Slot& sl = m_slots[s];
+        Heap h = heapOf(sl.order, stop);
+        int64_t px = (stop ? sl.order.stop : sl.order.limit).units();
+        b.heap[h].push_back(Entry{h == kFalls ? px : -px, sl.seq, s, sl.gen});
+        push_heap(b.heap[h].begin(), b.heap[h].end());
+    }
 
-    void buy(const string& sym, long long qty, double price) {
-        auto& h = m_holdings[sym];
-        if (h.quantity == 0) {
-            h.symbol = sym;
-            h.quantity = qty;
-            h.avgCost = price;
-        } else {
-            double totalCost = h.avgCost * h.quantity + price * qty;
-            h.quantity += qty;
-            h.avgCost = totalCost / static_cast<double>(h.quantity);
+    bool stale(const Entry& e) const { return m_slots[e.slot].gen != e.gen; }
+
+    void release(uint32_t s) {
+        Slot& sl = m_slots[s];
+        sl.live = false;
+        if (++sl.gen == 0) sl.gen = 1;
+        sl.next = m_free;
+        m_free = s;
+        --m_live;
+    }
+
+    // Drops dead entries from both heaps.
+    void compact(Book& b) {
+        for (auto& h : b.heap) {
+            h.erase(remove_if(h.begin(), h.end(), [this](const Entry& e) { return stale(e); }), h.end());
+            make_heap(h.begin(), h.end());
         }
+        b.dead = 0;
     }
 
-    double sell(const string& sym, long long qty, double price) {
-        auto it = m_holdings.find(sym);
-        if (it == m_holdings.end() || it->second.quantity < qty) {
-            throw runtime_error("Not enough shares to sell.");
+    void validate(const Order& o) const {
+        if (o.security >= m_market.size()) throw runtime_error("Symbol not found.");
+        if (o.quantity <= 0) throw runtime_error("Quantity must be positive.");
+        if (o.type != Type::Stop && o.limit <= Money()) throw runtime_error("Price must be positive.");
+        if (o.type != Type::Limit && o.stop <= Money()) throw runtime_error("Price must be positive.");
+    }
+
+public:
+    explicit TriggerBook(Market& market) : m_market(market) {}
+
+    TriggerBook(const TriggerBook&) = delete;
+    TriggerBook& operator=(const TriggerBook&) = delete;
+
+    ~TriggerBook() override {
+        for (SecId id = 0; id < m_books.size(); ++id)
+            if (m_books[id].watched) m_market.unwatch(id, this);
+    }
+
+    OrderId place(const Order& o) {
+        validate(o);
+        lock_guard<mutex> up(m_update);
+        bool watch;
+        OrderId id;
+        {
+            lock_guard<SpinLock> lk(m_lock);
+            if (m_books.size() <= o.security) m_books.resize(m_market.size());
+            uint32_t s = m_free;
+            if (s == kNil) {
+                m_slots.emplace_back();
+                s = static_cast<uint32_t>(m_slots.size() - 1);
+            } else {
+                m_free = m_slots[s].next;
+            }
+            Slot& sl = m_slots[s];
+            sl.order = o;
+            sl.seq = ++m_seq;
+            sl.live = true;
+            ++m_live;
+            Book& b = m_books[o.security];
+            push(b, s, o.type != Type::Limit);
+            ++b.live;
+            watch = !b.watched;
+            b.watched = true;
+            id = idOf(s);
         }
-        Holding& h = it->second;
-        double profit = (price - h.avgCost) * static_cast<double>(qty);
-        h.quantity -= qty;
-        if (h.quantity == 0) {
-            m_holdings.erase(it);
+        if (watch) m_market.watch(o.security, this);
+        return id;
+    }
+
+    // False if id is not pending (fired, cancelled or never issued).
+    bool cancel(OrderId id) {
+        lock_guard<mutex> up(m_update);
+        SecId drained = Market::npos;
+        {
+            lock_guard<SpinLock> lk(m_lock);
+            uint32_t s = static_cast<uint32_t>(id);
+            if (s >= m_slots.size() || m_slots[s].gen != id >> 32 || !m_slots[s].live) return false;
+            SecId sec = m_slots[s].order.security;
+            Book& b = m_books[sec];
+            release(s);
+            --b.live;
+            ++b.dead;
+            if (b.live == 0) {
+                b = Book();
+                drained = sec;
+            } else if (b.dead > b.live) {
+                compact(b);
+            }
         }
-        return profit;
+        if (drained != Market::npos) m_market.unwatch(drained, this);
+        return true;
     }
 
-    double marketValue(const Market& mkt) const {
-        double sum = 0.0;
-        for (auto& kv : m_holdings) {
-            auto* sec = mkt.get(kv.first);
-            if (sec) sum += sec->price() * static_cast<double>(kv.second.quantity);
+    void onPrice(SecId id, double price) override {
+        int64_t px = Money::fromDouble(price).units();
+        lock_guard<SpinLock> lk(m_lock);
+        Book& b = m_books[id];
+        if (b.live == 0) return;
+        const int64_t key[2] = {px, -px};
+        for (;;) {
+            int h = -1;
+            for (int i = 0; i < 2 && h < 0; ++i) {
+                auto& heap = b.heap[i];
+                while (!heap.empty() && stale(heap.front())) {
+                    pop_heap(heap.begin(), heap.end());
+                    heap.pop_back();
+                    --b.dead;
+                }
+                if (!heap.empty() && key[i] <= heap.front().key) h = i;
+            }
+            if (h < 0) break;
+            auto& heap = b.heap[h];
+            pop_heap(heap.begin(), heap.end());
+            uint32_t s = heap.back().slot;
+            heap.pop_back();
+            Slot& sl = m_slots[s];
+            if (sl.order.type == Type::StopLimit) {
+                sl.order.type = Type::Limit;
+                push(b, s, false);
+                continue;
+            }
+            m_fired.push_back(Fired{idOf(s), sl.order, Money::fromUnits(px)});
+            release(s);
+            if (--b.live == 0) m_drained.push_back(id);
         }
-        return sum;
     }
 
-    double unrealizedPnL(const Market& mkt) const {
-        double pnl = 0.0;
-        for (auto& kv : m_holdings) {
-            auto* sec = mkt.get(kv.first);
-            if (!sec) continue;
-            pnl += (sec->price() - kv.second.avgCost) * static_cast<double>(kv.second.quantity);
+    // False if filling o at price would be worse than its limit; stops have
+    // none.
+    static bool within(const Order& o, Money price) {
+        if (o.type == Type::Stop) return true;
+        return o.side == Side::Buy ? price <= o.limit : price >= o.limit;
+    }
+
+    // Hands over the orders fired since the last call, oldest first.
+    vector<Fired> take() {
+        lock_guard<mutex> up(m_update);
+        vector<Fired> fired;
+        vector<SecId> drained;
+        {
+            lock_guard<SpinLock> lk(m_lock);
+            fired.swap(m_fired);
+            for (SecId id : m_drained) {
+                Book& b = m_books[id];
+                if (b.live || !b.watched) continue;
+                b = Book();
+                drained.push_back(id);
+            }
+            m_drained.clear();
         }
-        return pnl;
+        for (SecId id : drained) m_market.unwatch(id, this);
+        return fired;
+    }
+
+    // The pending order behind id, if any.
+    optional<Order> order(OrderId id) const {
+        lock_guard<SpinLock> lk(m_lock);
+        uint32_t s = static_cast<uint32_t>(id);
+        if (s >= m_slots.size() || m_slots[s].gen != id >> 32 || !m_slots[s].live) return nullopt;
+        return m_slots[s].order;
     }
 
-    void clear() { m_holdings.clear(); }
+    // Calls fn(OrderId, const Order&) for owner's pending orders; O(all orders).
+    template <class Fn>
+    void forEach(uint32_t owner, Fn&& fn) const {
+        lock_guard<SpinLock> lk(m_lock);
+        for (uint32_t s = 0; s < m_slots.size(); ++s)
+            if (m_slots[s].live && m_slots[s].order.owner == owner) fn(idOf(s), m_slots[s].order);
+    }
+
+    size_t size() const {
+        lock_guard<SpinLock> lk(m_lock);
+        return m_live;
+    }
 };
 
-class User {
-    string m_name;
-    double m_balance = 0.0;      
-    double m_realizedPnL = 0.0;   
-    Portfolio m_portfolio;
+// Many accounts trading against one shared Market. Every account has its own
+// lock, so trades on different accounts run in parallel, and prices are
+// read from a pinned snapshot of the market's front frame, so trading never
+// blocks a concurrent tick.
+// Accounts live in fixed-size chunks that never move; lookups by id are
+// lock-free and safe while other threads open accounts.
+class Engine {
+public:
+    using AccountId = uint32_t;
+    static constexpr AccountId npos = numeric_limits<AccountId>::max();
+
+    enum class Side : uint8_t { Buy, Sell, Deposit };
+
+    struct Order {
+        AccountId account;
+        Side side;
+        SecId security;
+        long long quantity;
+        Money amount;  // Deposit only
+    };
+
+    struct Fill {
+        bool ok = false;
+        Money price;
+        string error;  // set for rejects only
+    };
+
+private:
+    struct Account {
+        mutex lock;
+        User user;
+        explicit Account(string name) : user(std::move(name)) {}
+    };
+
+    static constexpr size_t kChunkBits = 12;
+    static constexpr size_t kChunk = size_t{1} << kChunkBits;
+    static constexpr size_t kMaxChunks = 4096;  // 16M accounts
+    using Chunk = array<unique_ptr<Account>, kChunk>;
+
+    Market& m_market;
+    vector<atomic<Chunk*>> m_chunks;
+    atomic<size_t> m_count{0};
+    mutex m_openMutex;
+    mutable shared_mutex m_namesMutex;
+    unordered_map<string, AccountId> m_names;
+
+    Account& account(AccountId id) const {
+        if (id >= m_count.load(memory_order_acquire)) throw runtime_error("Unknown account.");
+        return *(*m_chunks[id >> kChunkBits].load(memory_order_acquire))[id & (kChunk - 1)];
+    }
 
 public:
-    explicit User(string name) : m_name(std::move(name)) {}
+    explicit Engine(Market& mkt) : m_market(mkt), m_chunks(kMaxChunks) {}
 
-    const string& name() const { return m_name; }
-    double balance() const { return m_balance; }
-    double realizedPnL() const { return m_realizedPnL; }
-    const Portfolio& portfolio() const { return m_portfolio; }
-    Portfolio& portfolio() { return m_portfolio; }
+    ~Engine() {
+        for (auto& c : m_chunks) delete c.load();
+    }
 
-    void addFunds(double amount) {
-        if (amount <= 0) throw runtime_error("Amount must be positive.");
-        m_balance += amount;
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+
+    AccountId open(const string& name, Money funds = Money()) {
+        lock_guard<mutex> lk(m_openMutex);
+        if (find(name) != npos) throw runtime_error("Account already exists.");
+        size_t id = m_count.load(memory_order_relaxed);
+        if (id >= kChunk * kMaxChunks) throw runtime_error("Too many accounts.");
+        auto& slot = m_chunks[id >> kChunkBits];
+        if (!slot.load(memory_order_relaxed)) slot.store(new Chunk(), memory_order_release);
+        auto acc = make_unique<Account>(name);
+        acc->user.portfolio().bind(m_market);
+        if (funds > Money()) acc->user.addFunds(funds);
+        (*slot.load(memory_order_relaxed))[id & (kChunk - 1)] = std::move(acc);
+        {
+            unique_lock<shared_mutex> names(m_namesMutex);
+            m_names.emplace(name, static_cast<AccountId>(id));
+        }
+        m_count.store(id + 1, memory_order_release);
+        return static_cast<AccountId>(id);
     }
 
-    void buy(Market& mkt, const string& sym, long long qty) {
-        if (qty <= 0) throw runtime_error("Quantity must be positive.");
-        Security* sec = mkt.get(sym);
-        if (!sec) throw runtime_error("Symbol not found.");
-        double cost = sec->price() * static_cast<double>(qty);
-        if (cost > m_balance + 1e-9) throw runtime_error("Insufficient balance.");
-        m_balance -= cost;
-        m_portfolio.buy(sym, qty, sec->price());
+    AccountId find(const string& name) const {
+        shared_lock<shared_mutex> lk(m_namesMutex);
+        auto it = m_names.find(name);
+        return it == m_names.end() ? npos : it->second;
     }
 
-    void sell(Market& mkt, const string& sym, long long qty) {
-        if (qty <= 0) throw runtime_error("Quantity must be positive.");
-        Security* sec = mkt.get(sym);
-        if (!sec) throw runtime_error("Symbol not found.");
-        double proceeds = sec->price() * static_cast<double>(qty);
-        double profit = m_portfolio.sell(sym, qty, sec->price());
-        m_balance += proceeds;
-        m_realizedPnL += profit;
+    size_t size() const { return m_count.load(memory_order_acquire); }
+    Market& market() const { return m_market; }
+
+    Money buy(AccountId a, SecId id, long long qty) {
+        Account& acc = account(a);
+        lock_guard<mutex> lk(acc.lock);
+        return acc.user.buy(m_market, id, qty);
     }
 
-    double totalEquity(const Market& mkt) const {
-        return m_balance + m_portfolio.marketValue(mkt);
+    Money sell(AccountId a, SecId id, long long qty) {
+        Account& acc = account(a);
+        lock_guard<mutex> lk(acc.lock);
+        return acc.user.sell(m_market, id, qty);
     }
 
-    // Persistence
-    void save(const string& filename) const {
-        ofstream out(filename);
-        if (!out) throw runtime_error("Failed to open save file.");
-        out.setf(std::ios::fixed); out << setprecision(8);
+    void addFunds(AccountId a, Money amount) {
+        Account& acc = account(a);
+        lock_guard<mutex> lk(acc.lock);
+        acc.user.addFunds(amount);
+    }
 
-        out << m_balance << " " << m_realizedPnL << "\n";
-        const auto& h = m_portfolio.all();
-        out << h.size() << "\n";
-        for (auto& kv : h) {
-            out << kv.second.symbol << ","
-                << kv.second.quantity << ","
-                << kv.second.avgCost << "\n";
+    // Runs fn(const User&) under the account's lock.
+    template <class Fn>
+    auto inspect(AccountId a, Fn&& fn) const {
+        Account& acc = account(a);
+        lock_guard<mutex> lk(acc.lock);
+        return fn(static_cast<const User&>(acc.user));
+    }
+
+    Money equity(AccountId a) const {
+        return inspect(a, [this](const User& u) { return u.totalEquity(m_market); });
+    }
+
+    Fill execute(const Order& o) {
+        Fill f;
+        try {
+            switch (o.side) {
+                case Side::Buy: f.price = buy(o.account, o.security, o.quantity); break;
+                case Side::Sell: f.price = sell(o.account, o.security, o.quantity); break;
+                case Side::Deposit: addFunds(o.account, o.amount); f.price = o.amount; break;
+            }
+            f.ok = true;
+        } catch (const exception& e) {
+            f.error = e.what();
         }
+        return f;
     }
 
-    void load(const string& filename) {
-        ifstream in(filename);
-        if (!in) return; 
-        double bal = 0.0, rp = 0.0;
-        size_t n = 0;
-        if (!(in >> bal >> rp)) return;
-        m_balance = bal; m_realizedPnL = rp;
-        string dummy; getline(in, dummy); 
-        string nline; if (!getline(in, nline)) return;
-        n = static_cast<size_t>(stoull(util::trim(nline)));
-        m_portfolio.clear();
-        for (size_t i = 0; i < n; ++i) {
-            string line; if (!getline(in, line)) break;
-            auto parts = util::splitCSV(line);
-            if (parts.size() != 3) continue;
-            Holding h;
-            h.symbol = parts[0];
-            h.quantity = stoll(parts[1]);
-            h.avgCost = stod(parts[2]);
-            m_portfolio.buy(h.symbol, h.quantity, h.avgCost); 
+    // Executes a batch across the pool. Accounts are sharded by id, so each
+    // account's orders run on one worker in submission order; the batch is
+    // bucketed by shard in one pass, and each worker walks only its bucket.
+    vector<Fill> execute(const vector<Order>& orders, ThreadPool& pool) {
+        vector<Fill> fills(orders.size());
+        const size_t shards = pool.size();
+        vector<vector<size_t>> buckets(shards);
+        for (auto& b : buckets) b.reserve(orders.size() / shards + 1);
+        for (size_t i = 0; i < orders.size(); ++i) buckets[orders[i].account % shards].push_back(i);
+        pool.run(shards, [&](size_t s) {
+            for (size_t i : buckets[s]) fills[i] = execute(orders[i]);
+        });
+        return fills;
+    }
+};
+
+// Headless order replay. Streams "account,side,symbol,qty" lines (side is
+// BUY, SELL or DEPOSIT; a deposit's qty is the amount and its symbol may be
+// empty) out of a mapped file with a single-pass parser, executes them in
+// chunks through Engine::execute, and writes one FILL or REJECT line per
+// order in input order. Unknown accounts are opened on first use.
+class BatchRunner {
+public:
+    struct Options {
+        Money openingFunds;
+        size_t chunk = 1 << 16;   // orders per Engine::execute call
+        size_t tickEvery = 0;     // orders between market ticks, 0 = never
+        uint64_t seed = 1;
+        PriceSource* source = nullptr;  // ticks come from here instead of the model
+    };
+
+    struct Stats {
+        size_t orders = 0, fills = 0, rejects = 0;
+    };
+
+private:
+    struct Pending {
+        Engine::Order order;
+        uint32_t line;
+        string_view account, side, symbol, qty;
+        const char* error;  // parse-time reject, or nullptr
+    };
+
+    Engine& m_engine;
+    Options m_opt;
+    unordered_map<string, Engine::AccountId> m_accounts;  // parse-side cache
+    string m_key;  // reused lookup buffer
+
+    static string_view trim(const char* b, const char* e) {
+        while (b < e && (*b == ' ' || *b == '\t')) ++b;
+        while (e > b && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r')) --e;
+        return string_view(b, static_cast<size_t>(e - b));
+    }
+
+    static bool sideIs(string_view s, const char* word) {
+        size_t n = strlen(word);
+        if (s.size() != n) return false;
+        for (size_t i = 0; i < n; ++i)
+            if (toupper(static_cast<unsigned char>(s[i])) != word[i]) return false;
+        return true;
+    }
+
+    Engine::AccountId account(string_view name) {
+        m_key.assign(name.data(), name.size());
+        auto it = m_accounts.find(m_key);
+        if (it != m_accounts.end()) return it->second;
+        Engine::AccountId id = m_engine.find(m_key);
+        if (id == Engine::npos) id = m_engine.open(m_key, m_opt.openingFunds);
+        m_accounts.emplace(m_key, id);
+        return id;
+    }
+
+    void parse(Pending& p) {
+        p.error = nullptr;
+        if (p.account.empty()) { p.error = "Missing account."; return; }
+        Engine::Order& o = p.order;
+        if (sideIs(p.side, "BUY")) o.side = Engine::Side::Buy;
+        else if (sideIs(p.side, "SELL")) o.side = Engine::Side::Sell;
+        else if (sideIs(p.side, "DEPOSIT")) o.side = Engine::Side::Deposit;
+        else { p.error = "Unknown side."; return; }
+        const char* qb = p.qty.data();
+        const char* qe = qb + p.qty.size();
+        if (o.side == Engine::Side::Deposit) {
+            if (!Money::parse(p.qty, o.amount)) { p.error = "Invalid amount."; return; }
+        } else {
+            auto r = from_chars(qb, qe, o.quantity);
+            if (r.ec != errc() || r.ptr != qe) { p.error = "Invalid quantity."; return; }
+            m_key.assign(p.symbol.data(), p.symbol.size());
+            for (auto& c : m_key) c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+            o.security = m_engine.market().find(m_key);
+            if (o.security == Market::npos) { p.error = "Symbol not found."; return; }
+        }
+        o.account = account(p.account);
+    }
+
+    void emit(string& out, const Pending& p, const Engine::Fill& f) {
+        char num[64];
+        out += f.ok ? "FILL," : "REJECT,";
+        auto r = to_chars(num, num + sizeof num, p.line);
+        out.append(num, r.ptr); out += ',';
+        out.append(p.account); out += ',';
+        out.append(p.side); out += ',';
+        out.append(p.symbol); out += ',';
+        out.append(p.qty); out += ',';
+        if (f.ok) {
+            char px[util::kMoneyChars];
+            out.append(px, util::formatMoney(px, px + sizeof px, f.price));
+        } else {
+            out += f.error;
+        }
+        out += '\n';
+    }
+
+    void flush(vector<Pending>& batch, ThreadPool& pool, FILE* out, Stats& st) {
+        vector<Engine::Order> orders;
+        vector<size_t> slot;  // batch index per engine order
+        orders.reserve(batch.size()); slot.reserve(batch.size());
+        for (size_t i = 0; i < batch.size(); ++i)
+            if (!batch[i].error) { orders.push_back(batch[i].order); slot.push_back(i); }
+        auto fills = m_engine.execute(orders, pool);
+
+        vector<Engine::Fill> results(batch.size());
+        for (size_t i = 0; i < batch.size(); ++i)
+            if (batch[i].error) results[i].error = batch[i].error;
+        for (size_t k = 0; k < fills.size(); ++k) results[slot[k]] = std::move(fills[k]);
+
+        string text;
+        text.reserve(batch.size() * 48);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            emit(text, batch[i], results[i]);
+            ++(results[i].ok ? st.fills : st.rejects);
+        }
+        fwrite(text.data(), 1, text.size(), out);
+        st.orders += batch.size();
+        batch.clear();
+    }
+
+public:
+    BatchRunner(Engine& engine, Options opt) : m_engine(engine), m_opt(opt) {}
+
+    Stats run(const MappedFile& in, FILE* out, ThreadPool& pool) {
+        Stats st;
+        size_t chunk = m_opt.chunk;
+        if (m_opt.tickEvery) chunk = min(chunk, m_opt.tickEvery);
+        vector<Pending> batch;
+        batch.reserve(chunk);
+        size_t sinceTick = 0;
+        const char* p = in.data();
+        const char* end = p + in.size();
+        uint32_t line = 0;
+        while (p < end) {
+            const char* eol = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end - p)));
+            if (!eol) eol = end;
+            ++line;
+            string_view fields[4];
+            size_t nf = 0;
+            for (const char* f = p; nf < 4; ++nf) {
+                const char* c = (nf < 3) ? static_cast<const char*>(memchr(f, ',', static_cast<size_t>(eol - f))) : nullptr;
+                fields[nf] = trim(f, c ? c : eol);
+                if (!c) { ++nf; break; }
+                f = c + 1;
+            }
+            p = eol + 1;
+            if (nf == 1 && (fields[0].empty() || fields[0][0] == '#')) continue;
+
+            Pending pd{};
+            pd.line = line;
+            pd.account = fields[0]; pd.side = fields[1]; pd.symbol = fields[2]; pd.qty = fields[3];
+            if (nf != 4) pd.error = "Expected account,side,symbol,qty.";
+            else parse(pd);
+            batch.push_back(pd);
+
+            if (batch.size() == chunk) {
+                sinceTick += batch.size();
+                flush(batch, pool, out, st);
+                if (m_opt.tickEvery && sinceTick >= m_opt.tickEvery) {
+                    if (m_opt.source) m_engine.market().tick(*m_opt.source);
+                    else m_engine.market().tick(pool, m_opt.seed);
+                    sinceTick = 0;
+                }
+            }
         }
+        if (!batch.empty()) flush(batch, pool, out, st);
+        return st;
     }
 };
 
@@ -264,7 +4111,13 @@ class App {
     Market market;
     User user;
     mt19937 rng;
-    const string saveFile = "portfolio.sav";
+    const string saveFile = "portfolio.sav";       // text import/export
+    const string snapshotFile = "portfolio.snap";  // binary, used for save/restore
+    const string journalFile = "portfolio.wal";    // trades since the snapshot
+    unique_ptr<Journal> journal;
+    TriggerBook triggers{market};  // this session's resting orders
+    unique_ptr<BarAggregator> bars;
+    unique_ptr<Indicators> indicators;
 
     static long long readLong(const string& prompt) {
         while (true) {
@@ -276,12 +4129,13 @@ class App {
         }
     }
 
-    static double readDouble(const string& prompt) {
+    static Money readMoney(const string& prompt) {
         while (true) {
             cout << prompt;
-            double x;
-            if (cin >> x) return x;
-            cout << "Invalid number. Try again.\n";
+            string s;
+            Money x;
+            if (cin >> s && Money::parse(s, x)) return x;
+            cout << "Invalid amount. Try again.\n";
             cin.clear(); cin.ignore(numeric_limits<streamsize>::max(), '\n');
         }
     }
@@ -293,17 +4147,20 @@ class App {
         return s;
     }
 
-    void seedMarket() {
-        market.addSecurity(make_unique<Stock>("AAPL", "Apple Inc.",         185.00, 0.010));
-        market.addSecurity(make_unique<Stock>("GOOG", "Alphabet Inc.",     2850.00, 0.012));
-        market.addSecurity(make_unique<Stock>("TSLA", "Tesla Inc.",         240.00, 0.020));
-        market.addSecurity(make_unique<Stock>("INFY", "Infosys Ltd.",        20.50, 0.015));
-        market.addSecurity(make_unique<Stock>("RELI", "Reliance Ind.",       28.00, 0.013));
-        market.addSecurity(make_unique<Stock>("NVDA", "NVIDIA Corp.",       950.00, 0.018));
-        market.addSecurity(make_unique<Stock>("TCS",  "Tata Consultancy",    40.00, 0.010));
-        market.addSecurity(make_unique<Stock>("HDFB", "HDFC Bank",           18.50, 0.011));
+public:
+    static void seedMarket(Market& market) {
+        market.addStock("AAPL", "Apple Inc.",         185.00, 0.010);
+        market.addStock("GOOG", "Alphabet Inc.",     2850.00, 0.012);
+        market.addStock("TSLA", "Tesla Inc.",         240.00, 0.020);
+        market.addStock("INFY", "Infosys Ltd.",        20.50, 0.015);
+        market.addStock("RELI", "Reliance Ind.",       28.00, 0.013);
+        market.addStock("NVDA", "NVIDIA Corp.",       950.00, 0.018);
+        market.addStock("TCS",  "Tata Consultancy",    40.00, 0.010);
+        market.addStock("HDFB", "HDFC Bank",           18.50, 0.011);
     }
 
+private:
+
     void showHeader() const {
         cout << "\n=============================================\n";
         cout << "    Virtual Stock Portfolio Simulator\n";
@@ -313,13 +4170,13 @@ class App {
 
     void showDashboard() const {
         cout << "\n--- Dashboard ---\n";
-        cout << "Cash Balance   : $" << util::toMoney(user.balance()) << "\n";
-        double mv = user.portfolio().marketValue(market);
-        double upnl = user.portfolio().unrealizedPnL(market);
-        cout << "Mkt Value      : $" << util::toMoney(mv) << "\n";
-        cout << "Unrealized P/L : $" << util::toMoney(upnl) << "\n";
-        cout << "Realized P/L   : $" << util::toMoney(user.realizedPnL()) << "\n";
-        cout << "Total Equity   : $" << util::toMoney(user.totalEquity(market)) << "\n";
+        cout << "Cash Balance   : $" << util::money(user.balance()) << "\n";
+        Money mv = user.portfolio().marketValue(market);
+        Money upnl = user.portfolio().unrealizedPnL(market);
+        cout << "Mkt Value      : $" << util::money(mv) << "\n";
+        cout << "Unrealized P/L : $" << util::money(upnl) << "\n";
+        cout << "Realized P/L   : $" << util::money(user.realizedPnL()) << "\n";
+        cout << "Total Equity   : $" << util::money(user.totalEquity(market)) << "\n";
     }
 
     void showPortfolio() const {
@@ -333,30 +4190,43 @@ class App {
         cout << string(58, '-') << "\n";
         vector<Holding> v;
         for (auto& kv : user.portfolio().all()) v.push_back(kv.second);
-        sort(v.begin(), v.end(), [](const Holding& a, const Holding& b){ return a.symbol < b.symbol; });
-        double totalUnreal = 0.0;
+        sort(v.begin(), v.end(), [this](const Holding& a, const Holding& b){
+            return market.symbol(a.id) < market.symbol(b.id);
+        });
+        PriceView view = market.snapshot();
+        Money totalUnreal;
         for (auto& h : v) {
-            auto* sec = market.get(h.symbol);
-            if (!sec) continue;
-            double price = sec->price();
-            double pnl = (price - h.avgCost) * static_cast<double>(h.quantity);
+            Money price = Money::fromDouble(view[h.id]);
+            Money pnl = price * h.quantity - h.cost;
             totalUnreal += pnl;
-            cout << left << setw(8) << h.symbol
+            cout << left << setw(8) << market.symbol(h.id)
                  << right << setw(10) << h.quantity
-                 << right << setw(14) << util::toMoney(h.avgCost)
-                 << right << setw(12) << util::toMoney(price)
-                 << right << setw(14) << util::toMoney(pnl)
+                 << right << setw(14) << util::money(h.avgCost())
+                 << right << setw(12) << util::money(price)
+                 << right << setw(14) << util::money(pnl)
                  << "\n";
         }
         cout << string(58, '-') << "\n";
-        cout << right << setw(44) << "Total Unrealized: " << setw(14) << util::toMoney(totalUnreal) << "\n";
+        cout << right << setw(44) << "Total Unrealized: " << setw(14) << util::money(totalUnreal) << "\n";
+    }
+
+    void showRisk() const {
+        ThreadPool pool;
+        RiskEngine::Options opt;
+        RiskEngine::Report r = RiskEngine(market, pool).run(user.portfolio(), {0.95, 0.99}, opt);
+        cout << "\n--- Risk (" << r.paths << " paths, " << r.horizon << " tick ahead) ---\n";
+        cout << "Mkt Value      : $" << util::money(r.value) << "\n";
+        for (auto& l : r.levels) {
+            cout << "VaR " << setw(3) << lround(l.confidence * 100) << "%       : $" << util::money(l.var) << "\n";
+            cout << "ES  " << setw(3) << lround(l.confidence * 100) << "%       : $" << util::money(l.es) << "\n";
+        }
     }
 
     void doAddFunds() {
-        double amt = readDouble("Enter amount to add: $");
+        Money amt = readMoney("Enter amount to add: $");
         try {
             user.addFunds(amt);
-            cout << "Added $" << util::toMoney(amt) << " successfully.\n";
+            cout << "Added $" << util::money(amt) << " successfully.\n";
         } catch (const exception& e) {
             cout << "Error: " << e.what() << "\n";
         }
@@ -384,10 +4254,98 @@ class App {
         }
     }
 
+    void doOrder() {
+        string sym = readSymbolUpper("Enter symbol: ");
+        string side = readSymbolUpper("Buy or sell (B/S): ");
+        string type = readSymbolUpper("Type (L = limit, S = stop, SL = stop-limit): ");
+        TriggerBook::Order o{};
+        try {
+            if (side != "B" && side != "S") throw runtime_error("Side must be B or S.");
+            if (type != "L" && type != "S" && type != "SL") throw runtime_error("Type must be L, S or SL.");
+            o.security = market.find(sym);
+            if (o.security == Market::npos) throw runtime_error("Symbol not found.");
+            o.side = side == "B" ? TriggerBook::Side::Buy : TriggerBook::Side::Sell;
+            o.type = type == "L" ? TriggerBook::Type::Limit : type == "S" ? TriggerBook::Type::Stop : TriggerBook::Type::StopLimit;
+        } catch (const exception& e) {
+            cout << "Error: " << e.what() << "\n";
+            return;
+        }
+        o.quantity = readLong("Enter quantity: ");
+        if (o.type != TriggerBook::Type::Limit) o.stop = readMoney("Stop price: $");
+        if (o.type != TriggerBook::Type::Stop) o.limit = readMoney("Limit price: $");
+        try {
+            TriggerBook::OrderId id = triggers.place(o);
+            cout << "Order #" << id << " placed.\n";
+        } catch (const exception& e) {
+            cout << "Error: " << e.what() << "\n";
+        }
+    }
+
+    void showOrders() {
+        static const char* kTypes[] = {"Limit", "Stop", "StopLimit"};
+        cout << "\n--- Pending Orders ---\n";
+        size_t n = 0;
+        triggers.forEach(0, [&](TriggerBook::OrderId id, const TriggerBook::Order& o) {
+            cout << "#" << left << setw(14) << id << setw(8) << market.symbol(o.security)
+                 << setw(5) << (o.side == TriggerBook::Side::Buy ? "BUY" : "SELL")
+                 << setw(10) << kTypes[static_cast<int>(o.type)] << right << setw(8) << o.quantity;
+            if (o.type != TriggerBook::Type::Limit) cout << "  stop $" << util::money(o.stop);
+            if (o.type != TriggerBook::Type::Stop) cout << "  limit $" << util::money(o.limit);
+            cout << "\n";
+            ++n;
+        });
+        if (n == 0) { cout << "(none)\n"; return; }
+        long long id = readLong("Order # to cancel (0 = keep all): ");
+        if (id == 0) return;
+        cout << (triggers.cancel(static_cast<TriggerBook::OrderId>(id)) ? "Cancelled.\n" : "No such order.\n");
+    }
+
+    void showIndicators() const {
+        using K = Indicators::Kind;
+        vector<ListColumn> cols;
+        for (K k : {K::SMA, K::RSI, K::MACD, K::LowerBand, K::UpperBand}) cols.push_back(indicators->column(k));
+        market.list(0, numeric_limits<size_t>::max(), cols);
+    }
+
+    void showBars() const {
+        string sym = readSymbolUpper("Enter symbol: ");
+        SecId id = market.find(sym);
+        if (id == Market::npos) { cout << "Error: Symbol not found.\n"; return; }
+        for (const BarSeries& s : bars->all()) {
+            cout << "\n--- " << sym << " " << s.length() << "-tick bars ---\n";
+            cout << right << setw(8) << "Tick" << setw(12) << "Open" << setw(12) << "High"
+                 << setw(12) << "Low" << setw(12) << "Close" << setw(10) << "Volume" << "\n";
+            if (s.count() == 0) cout << "(none yet)\n";
+            for (size_t age = min<size_t>(s.count(), 10); age-- > 0;) {
+                Bar b = s.bar(id, age);
+                cout << setw(8) << b.tick << setw(12) << util::money(b.open) << setw(12) << util::money(b.high)
+                     << setw(12) << util::money(b.low) << setw(12) << util::money(b.close)
+                     << setw(10) << b.volume << "\n";
+            }
+        }
+    }
+
+    // Fills the resting orders the last tick fired, at market.
+    void runTriggered() {
+        for (auto& f : triggers.take()) {
+            string_view sym = market.symbol(f.order.security);
+            try {
+                if (!TriggerBook::within(f.order, Money::fromDouble(market.price(f.order.security))))
+                    throw runtime_error("Price moved past the limit.");
+                if (f.order.side == TriggerBook::Side::Buy) user.buy(market, f.order.security, f.order.quantity);
+                else user.sell(market, f.order.security, f.order.quantity);
+                cout << "Order #" << f.id << " filled: " << (f.order.side == TriggerBook::Side::Buy ? "bought " : "sold ")
+                     << f.order.quantity << " of " << sym << ".\n";
+            } catch (const exception& e) {
+                cout << "Order #" << f.id << " (" << sym << ") failed: " << e.what() << "\n";
+            }
+        }
+    }
+
     void save() {
         try {
-            user.save(saveFile);
-            cout << "Progress saved to " << saveFile << ".\n";
+            user.compact(market);
+            cout << "Progress saved to " << snapshotFile << ".\n";
         } catch (const exception& e) {
             cout << "Save error: " << e.what() << "\n";
         }
@@ -397,11 +4355,17 @@ public:
     explicit App(string username)
         : user(std::move(username)),
           rng(static_cast<uint32_t>(chrono::high_resolution_clock::now().time_since_epoch().count())) {
-        seedMarket();
-        user.load(saveFile);
-        if (user.balance() <= 1e-9 && user.portfolio().all().empty()) {
+        seedMarket(market);
+        bars = make_unique<BarAggregator>(market, 64);
+        indicators = make_unique<Indicators>(market);
+        user.portfolio().bind(market);
+        if (!user.loadSnapshot(snapshotFile, market)) user.load(saveFile, market);
+        user.replay(journalFile, market);
+        journal = make_unique<Journal>(journalFile, user.journalSeq());
+        user.attachJournal(journal.get(), snapshotFile);
+        if (user.balance() <= Money() && user.portfolio().all().empty()) {
             cout << "Starting with demo funds: $10,000.00\n";
-            user.addFunds(10000.0);
+            user.addFunds(Money::fromUnits(10000 * Money::kScale));
         }
     }
 
@@ -409,6 +4373,7 @@ public:
         bool running = true;
         while (running) {
             market.tick(rng); 
+            runTriggered();
 
             showHeader();
             showDashboard();
@@ -421,6 +4386,11 @@ public:
             cout << " 5) Sell Stock\n";
             cout << " 6) Save Progress\n";
             cout << " 7) Exit\n";
+            cout << " 8) Risk Report\n";
+            cout << " 9) Limit/Stop Order\n";
+            cout << "10) Pending Orders\n";
+            cout << "11) Price Bars\n";
+            cout << "12) Indicators\n";
             cout << "Choose: ";
 
             int choice;
@@ -443,6 +4413,11 @@ public:
                     cout << "Goodbye!\n";
                     running = false;
                     break;
+                case 8: showRisk(); break;
+                case 9: doOrder(); break;
+                case 10: showOrders(); break;
+                case 11: showBars(); break;
+                case 12: showIndicators(); break;
                 default:
                     cout << "Invalid choice. Try again.\n";
             }
@@ -450,7 +4425,93 @@ public:
     }
 };
 
-int main() {
+#ifndef IMP_NO_MAIN
+// A square matrix as CSV, one row per line.
+static vector<double> readMatrix(const string& path) {
+    MappedFile f(path);
+    if (!f) throw runtime_error("Cannot read " + path);
+    vector<double> m;
+    util::CsvReader csv(f.data(), f.size());
+    while (csv.next()) {
+        for (size_t i = 0; i < csv.size(); ++i) {
+            double v;
+            string_view x = csv[i];
+            auto r = from_chars(x.data(), x.data() + x.size(), v);
+            if (r.ec != errc() || r.ptr != x.data() + x.size()) throw runtime_error("Bad number in " + path);
+            m.push_back(v);
+        }
+    }
+    return m;
+}
+
+// imp --batch ORDERS [--out FILE] [--funds N] [--threads N] [--tick-every N] [--seed N]
+//     [--replay TICKS [--replay-from TIMESTAMP] | --corr MATRIX]
+static int runBatch(int argc, char** argv) {
+    string ordersFile, outFile, replayFile, corrFile;
+    int64_t replayFrom = numeric_limits<int64_t>::min();
+    size_t threads = thread::hardware_concurrency();
+    BatchRunner::Options opt;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        auto next = [&]() -> string {
+            if (i + 1 >= argc) throw runtime_error("Missing value for " + a);
+            return argv[++i];
+        };
+        if (a == "--batch") ordersFile = next();
+        else if (a == "--out") outFile = next();
+        else if (a == "--funds") {
+            if (!Money::parse(next(), opt.openingFunds)) throw runtime_error("Invalid amount for --funds");
+        }
+        else if (a == "--threads") threads = stoul(next());
+        else if (a == "--tick-every") opt.tickEvery = stoul(next());
+        else if (a == "--seed") opt.seed = stoull(next());
+        else if (a == "--replay") replayFile = next();
+        else if (a == "--replay-from") replayFrom = stoll(next());
+        else if (a == "--corr") corrFile = next();
+        else throw runtime_error("Unknown option " + a);
+    }
+    MappedFile in(ordersFile);
+    if (!in) throw runtime_error("Cannot read " + ordersFile);
+    FILE* out = outFile.empty() ? stdout : fopen(outFile.c_str(), "w");
+    if (!out) throw runtime_error("Cannot write " + outFile);
+
+    Market market;
+    App::seedMarket(market);
+    unique_ptr<ReplaySource> replay;
+    if (!replayFile.empty()) {
+        replay = make_unique<ReplaySource>(replayFile, market);
+        replay->seek(replayFrom);
+        opt.source = replay.get();
+    }
+    mt19937 corrRng(opt.seed);
+    unique_ptr<CholeskySource> corr;
+    if (!corrFile.empty()) {
+        if (replay) throw runtime_error("--corr and --replay cannot be combined");
+        corr = make_unique<CholeskySource>(corrRng, readMatrix(corrFile), market.size());
+        opt.source = corr.get();
+    }
+    Engine engine(market);
+    ThreadPool pool(threads);
+    BatchRunner runner(engine, opt);
+    auto t0 = chrono::steady_clock::now();
+    auto st = runner.run(in, out, pool);
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    if (out != stdout) fclose(out); else fflush(out);
+    cerr << st.orders << " orders, " << st.fills << " fills, " << st.rejects << " rejects in "
+         << secs << "s (" << static_cast<double>(st.orders) / max(secs, 1e-9) << " orders/s)\n";
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        try {
+            return runBatch(argc, argv);
+        } catch (const std::exception& e) {
+            cerr << "Batch error: " << e.what() << endl;
+            return 1;
+        }
+    }
+
     ios::sync_with_stdio(false);
     cin.tie(nullptr);
     cout.tie(nullptr);
@@ -477,3 +4538,4 @@ int main() {
     cout << "\nProgram finished successfully.\n";
     return 0;
 }
+#endif
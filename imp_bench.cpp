@@ -0,0 +1,849 @@
+// Throughput benchmarks for imp.cpp (Google Benchmark).
+//   g++ -std=c++17 -O2 imp_bench.cpp -lbenchmark -lpthread -o imp_bench
+//   ./imp_bench --benchmark_out=bench.json --benchmark_out_format=json
+#define IMP_NO_MAIN
+#include "imp.cpp"
+#include <benchmark/benchmark.h>
+#include <malloc.h>
+
+// Global allocation counters, for the allocation benchmarks below.
+static atomic<size_t> g_allocs{0};
+static atomic<size_t> g_liveBytes{0};
+
+static void* counted(void* p) {
+    if (!p) throw bad_alloc();
+    g_allocs.fetch_add(1, memory_order_relaxed);
+    g_liveBytes.fetch_add(malloc_usable_size(p), memory_order_relaxed);
+    return p;
+}
+static void uncount(void* p) {
+    if (p) g_liveBytes.fetch_sub(malloc_usable_size(p), memory_order_relaxed);
+}
+
+// noinline keeps GCC from pairing these new/delete bodies' malloc and free.
+__attribute__((noinline)) void* operator new(size_t n) { return counted(malloc(n ? n : 1)); }
+__attribute__((noinline)) void* operator new(size_t n, align_val_t a) {
+    size_t al = max(static_cast<size_t>(a), sizeof(void*));
+    return counted(aligned_alloc(al, (max<size_t>(n, 1) + al - 1) / al * al));
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept { uncount(p); free(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete(void* p, align_val_t) noexcept { operator delete(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { operator delete(p); }
+
+static void fillMarket(Market& m, size_t n) {
+    m.reserve(n);
+    for (size_t i = 0; i < n; ++i)
+        m.addStock("S" + to_string(i), "Security " + to_string(i),
+                   10.0 + static_cast<double>(i % 500), 0.010 + 0.00001 * static_cast<double>(i % 1000));
+}
+
+static string benchPath(const char* name) {
+    return (filesystem::temp_directory_path() / name).string();
+}
+
+// A user holding `n` distinct securities out of an n-security market.
+static void fillUser(User& u, Market& m, size_t n) {
+    u.addFunds(Money::fromDouble(1e14));
+    for (SecId id = 0; id < n; ++id) u.buy(m, id, 1 + id % 7);
+}
+
+// One 50-row page from the end of the symbol order, against sorting every
+// id by symbol the way Market::list used to.
+static void BM_MarketPage(benchmark::State& state) {
+    Market m;
+    fillMarket(m, static_cast<size_t>(state.range(0)));
+    const size_t offset = m.size() - min<size_t>(m.size(), 50);
+    for (auto _ : state) {
+        SecId last = 0;
+        m.forEachBySymbol(offset, 50, [&](SecId id) { last = id; });
+        benchmark::DoNotOptimize(last);
+    }
+}
+BENCHMARK(BM_MarketPage)->Arg(1000)->Arg(100000);
+
+static void BM_MarketPageBySort(benchmark::State& state) {
+    Market m;
+    fillMarket(m, static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        vector<SecId> v(m.size());
+        iota(v.begin(), v.end(), SecId{0});
+        sort(v.begin(), v.end(), [&](SecId a, SecId b) { return m.symbol(a) < m.symbol(b); });
+        benchmark::DoNotOptimize(v.back());
+    }
+}
+BENCHMARK(BM_MarketPageBySort)->Arg(1000)->Arg(100000);
+
+// Building a universe whose symbols arrive in no particular order.
+static void BM_MarketAddSecurityShuffled(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0));
+    vector<string> syms(n);
+    for (size_t i = 0; i < n; ++i) syms[i] = "S" + to_string(i);
+    shuffle(syms.begin(), syms.end(), mt19937(7));
+    for (auto _ : state) {
+        Market m;
+        m.reserve(n);
+        for (auto& s : syms) m.addSecurity(make_unique<Stock>(s, s, 10.0, 0.01));
+        benchmark::DoNotOptimize(m.size());
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+}
+BENCHMARK(BM_MarketAddSecurityShuffled)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+// Security-price updates per second through Market::tick.
+static void BM_MarketTick(benchmark::State& state) {
+    Market m;
+    fillMarket(m, static_cast<size_t>(state.range(0)));
+    mt19937 rng(42);
+    for (auto _ : state) {
+        m.tick(rng);
+        benchmark::DoNotOptimize(m.prices());
+    }
+    state.counters["ticks/s"] = benchmark::Counter(static_cast<double>(state.iterations()) * state.range(0),
+                                                   benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_MarketTick)->Arg(10)->Arg(1000)->Arg(100000);
+
+// BM_MarketTick with a 64-deep price history and 1/5/60-tick bars (16 deep)
+// over the whole universe recorded on every tick; the second argument is the
+// number of steps per tick() call, and every step must still close a 1-tick bar.
+static void BM_MarketTickRecorded(benchmark::State& state) {
+    Market m;
+    fillMarket(m, static_cast<size_t>(state.range(0)));
+    const int steps = static_cast<int>(state.range(1));
+    PriceHistory history(m, 64);
+    BarAggregator bars(m, 16);
+    mt19937 rng(42);
+    for (auto _ : state) {
+        m.tick(rng, steps);
+        benchmark::DoNotOptimize(history.frame(0));
+    }
+    if (bars.series(1).bar(0, 0).tick != m.tickCount()) state.SkipWithError("Bars skipped ticks.");
+    state.counters["ticks/s"] = benchmark::Counter(static_cast<double>(state.iterations()) * state.range(0) * steps,
+                                                   benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_MarketTickRecorded)->Args({1000, 1})->Args({100000, 1})->Args({1000, 5});
+
+// One Indicators update over the universe, fed directly (no market tick) with
+// a few alternating price columns once the windows are full.
+static void BM_IndicatorsUpdate(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0));
+    Market m;
+    fillMarket(m, n);
+    Indicators ind(m);
+    mt19937 rng(42);
+    vector<vector<double>> cols(4, vector<double>(m.prices(), m.prices() + n));
+    for (size_t c = 1; c < cols.size(); ++c) {
+        m.tick(rng);
+        copy_n(m.prices(), n, cols[c].begin());
+    }
+    uint64_t t = 0;
+    for (size_t k = 0; k < 64; ++k, ++t) ind.onTick(TickColumns{cols[t & 3].data(), nullptr, n, t});
+    for (auto _ : state) {
+        ind.onTick(TickColumns{cols[t & 3].data(), nullptr, n, t});
+        ++t;
+    }
+    benchmark::DoNotOptimize(ind.value(Indicators::Kind::RSI, 0));
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * n));
+}
+BENCHMARK(BM_IndicatorsUpdate)->Arg(1000)->Arg(100000);
+
+// Compressing every tick of a 10k-security market into a TickStore; items
+// are samples, and "ratio" is raw (16-byte) samples over stored bytes.
+static void BM_TickStoreAppend(benchmark::State& state) {
+    const size_t n = 10000;
+    Market m;
+    fillMarket(m, n);
+    mt19937 rng(42);
+    vector<vector<double>> cols;
+    for (int c = 0; c < 64; ++c) {
+        m.tick(rng);
+        cols.emplace_back(m.prices(), m.prices() + n);
+    }
+    TickStore store(m, benchPath("bench_ticks.store"), 1024, 0, true);  // fed directly below
+    uint64_t t = 0;
+    for (auto _ : state) {
+        store.onTick(TickColumns{cols[t & 63].data(), nullptr, n, t});
+        ++t;
+    }
+    state.counters["ratio"] = store.stats().ratio();
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * n));
+}
+BENCHMARK(BM_TickStoreAppend)->Unit(benchmark::kMicrosecond);
+
+// Sequential decode of one security's 100k ticks, mostly from spilled blocks.
+static void BM_TickStoreScan(benchmark::State& state) {
+    Market m;
+    fillMarket(m, 1);
+    TickStore store(m, benchPath("bench_scan.store"), 1024, 0, true);
+    mt19937 rng(42);
+    for (int i = 0; i < 100000; ++i) m.tick(rng);
+    store.flush();
+    for (auto _ : state) {
+        double sum = 0;
+        store.scan(0, 0, numeric_limits<int64_t>::max(), [&](int64_t, double px) { sum += px; });
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * 100000));
+}
+BENCHMARK(BM_TickStoreScan)->Unit(benchmark::kMicrosecond);
+
+// Sharded counter-based tick; Arg(1) is the thread count.
+static void BM_MarketTickParallel(benchmark::State& state) {
+    Market m;
+    fillMarket(m, static_cast<size_t>(state.range(0)));
+    ThreadPool pool(static_cast<size_t>(state.range(1)));
+    for (auto _ : state) {
+        m.tick(pool, 42);
+        benchmark::DoNotOptimize(m.prices());
+    }
+    state.counters["ticks/s"] = benchmark::Counter(static_cast<double>(state.iterations()) * state.range(0),
+                                                   benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_MarketTickParallel)->Args({100000, 1})->Args({100000, 4})->UseRealTime();
+
+// Ticks while Arg(1) other threads keep summing whole-market views; the
+// readers never stall the ticker.
+static void BM_MarketTickWithReaders(benchmark::State& state) {
+    Market m;
+    fillMarket(m, static_cast<size_t>(state.range(0)));
+    ThreadPool pool(1);
+    atomic<bool> stop{false};
+    atomic<int64_t> views{0};
+    vector<thread> readers;
+    for (int64_t r = 0; r < state.range(1); ++r)
+        readers.emplace_back([&] {
+            while (!stop.load(memory_order_relaxed)) {
+                PriceView v = m.snapshot();
+                benchmark::DoNotOptimize(accumulate(v.data(), v.data() + v.size(), 0.0));
+                views.fetch_add(1, memory_order_relaxed);
+            }
+        });
+    for (auto _ : state) m.tick(pool, 42);
+    stop = true;
+    for (auto& t : readers) t.join();
+    state.counters["ticks/s"] = benchmark::Counter(static_cast<double>(state.iterations()) * state.range(0),
+                                                   benchmark::Counter::kIsRate);
+    state.counters["views"] = static_cast<double>(views.load());
+}
+BENCHMARK(BM_MarketTickWithReaders)->Args({100000, 0})->Args({100000, 2})->UseRealTime();
+
+// Pinning a view and reading one price from it.
+static void BM_MarketSnapshot(benchmark::State& state) {
+    Market m;
+    fillMarket(m, 1000);
+    for (auto _ : state) benchmark::DoNotOptimize(m.snapshot()[7]);
+}
+BENCHMARK(BM_MarketSnapshot);
+
+// Equicorrelated universe (rho 0.3), the dense matrix a CholeskySource takes.
+static vector<double> equicorrelation(size_t n) {
+    vector<double> c(n * n, 0.3);
+    for (size_t i = 0; i < n; ++i) c[i * n + i] = 1.0;
+    return c;
+}
+
+static void BM_CholeskyFactor(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0));
+    const vector<double> c = equicorrelation(n);
+    mt19937 rng(42);
+    for (auto _ : state) CholeskySource src(rng, c, n);
+}
+BENCHMARK(BM_CholeskyFactor)->Arg(1000)->Arg(4000)->Unit(benchmark::kMillisecond);
+
+// Correlated ticks from a dense factor.
+static void BM_MarketTickCholesky(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0));
+    Market m;
+    fillMarket(m, n);
+    mt19937 rng(42);
+    CholeskySource src(rng, equicorrelation(n), n);
+    for (auto _ : state) m.tick(src);
+    state.counters["ticks/s"] = benchmark::Counter(static_cast<double>(state.iterations()) * state.range(0),
+                                                   benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_MarketTickCholesky)->Arg(1000)->Arg(4000);
+
+// Correlated ticks from a k-factor model; Args are n and k.
+static void BM_MarketTickFactor(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0)), k = static_cast<size_t>(state.range(1));
+    Market m;
+    fillMarket(m, n);
+    mt19937 rng(42);
+    vector<double> loading(n * k);
+    for (size_t i = 0; i < loading.size(); ++i) loading[i] = 0.1 + 0.01 * static_cast<double>(i % 17);
+    FactorSource src(rng, std::move(loading), vector<double>(n, 0.5), k);
+    for (auto _ : state) m.tick(src);
+    state.counters["ticks/s"] = benchmark::Counter(static_cast<double>(state.iterations()) * state.range(0),
+                                                   benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_MarketTickFactor)->Args({4000, 10})->Args({100000, 20});
+
+// An extension instrument outside the Stock group: a bond accruing toward par.
+class Bond : public Security {
+    string m_symbol, m_name;
+    double m_price;
+public:
+    Bond(string sym, double price) : m_symbol(std::move(sym)), m_name("Bond"), m_price(price) {}
+    const string& symbol() const override { return m_symbol; }
+    const string& name() const override { return m_name; }
+    double price() const override { return m_price; }
+    double volatility() const override { return 0.0; }
+    double drift() const override { return 0.0; }
+    void updatePrice(std::mt19937&) override { m_price += (100.0 - m_price) * 0.001; }
+};
+
+// 100k instruments, every 100th an adapter: the Stock runs stay on the
+// kernel and only the adapters pay a virtual call.
+static void BM_MarketTickMixed(benchmark::State& state) {
+    Market m;
+    for (size_t i = 0; i < 100000; ++i) {
+        if (i % 100 == 0) m.addSecurity(make_unique<Bond>("B" + to_string(i), 95.0));
+        else m.addSecurity(make_unique<Stock>("S" + to_string(i), "Security", 10.0 + static_cast<double>(i % 500), 0.01));
+    }
+    mt19937 rng(42);
+    for (auto _ : state) {
+        m.tick(rng);
+        benchmark::DoNotOptimize(m.prices());
+    }
+    state.counters["ticks/s"] = benchmark::Counter(static_cast<double>(state.iterations()) * 100000,
+                                                   benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_MarketTickMixed);
+
+// Historical replay: every security updates at each of 1000 timestamps.
+static void BM_ReplayTick(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0));
+    Market m;
+    fillMarket(m, n);
+    vector<string> syms(n);
+    for (SecId id = 0; id < n; ++id) syms[id] = m.symbol(id);
+    vector<ticks::Record> recs;
+    recs.reserve(n * 1000);
+    for (int64_t t = 0; t < 1000; ++t)
+        for (uint32_t s = 0; s < n; ++s) recs.push_back({t, 10.0 + static_cast<double>(t % 7), s, 0});
+    const string path = benchPath("imp_bench.ticks");
+    ticks::write(path, syms, recs);
+    ReplaySource src(path, m);
+    for (auto _ : state) {
+        if (src.done()) src.rewind();
+        m.tick(src);
+    }
+    state.counters["updates/s"] = benchmark::Counter(static_cast<double>(state.iterations()) * static_cast<double>(n),
+                                                     benchmark::Counter::kIsRate);
+    remove(path.c_str());
+}
+BENCHMARK(BM_ReplayTick)->Arg(1000)->Arg(100000);
+
+// The per-object virtual path the batch kernel replaces.
+static void BM_StockUpdatePrice(benchmark::State& state) {
+    vector<unique_ptr<Security>> v;
+    for (int64_t i = 0; i < state.range(0); ++i) v.push_back(make_unique<Stock>("S", "S", 100.0, 0.01));
+    mt19937 rng(42);
+    for (auto _ : state) {
+        for (auto& s : v) s->updatePrice(rng);
+        benchmark::ClobberMemory();
+    }
+    state.counters["ticks/s"] = benchmark::Counter(static_cast<double>(state.iterations()) * state.range(0),
+                                                   benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_StockUpdatePrice)->Arg(100000);
+
+// Normal generation + GBM step per ISA, without the RNG draw.
+static void BM_GbmKernel(benchmark::State& state, const simd::Kernels& k) {
+    const size_t n = simd::kBlock;
+    vector<double> px(n, 100.0), drift(n, model::kDrift), vol(n, 0.01), u(n), z(n);
+    mt19937 rng(42);
+    for (auto& x : u) x = (static_cast<double>(rng()) + 0.5) * 0x1p-32;
+    state.SetLabel(k.isa);
+    for (auto _ : state) {
+        z = u;
+        k.boxMuller(z.data(), n / 2);
+        k.gbm(px.data(), drift.data(), vol.data(), z.data(), n);
+        benchmark::DoNotOptimize(px.data());
+    }
+    state.counters["ticks/s"] = benchmark::Counter(static_cast<double>(state.iterations()) * n,
+                                                   benchmark::Counter::kIsRate);
+}
+BENCHMARK_CAPTURE(BM_GbmKernel, scalar, simd::scalarKernels());
+BENCHMARK_CAPTURE(BM_GbmKernel, native, simd::kernels());
+
+// Batch of buy orders spread over many accounts; Arg(0) is the thread count.
+static void BM_EngineExecute(benchmark::State& state) {
+    Market m;
+    fillMarket(m, 1000);
+    Engine e(m);
+    for (int i = 0; i < 10000; ++i) e.open("u" + to_string(i), Money::fromDouble(1e12));
+    ThreadPool pool(static_cast<size_t>(state.range(0)));
+    vector<Engine::Order> orders;
+    mt19937 rng(42);
+    for (int i = 0; i < 100000; ++i)
+        orders.push_back({static_cast<Engine::AccountId>(rng() % 10000), Engine::Side::Buy,
+                          static_cast<SecId>(rng() % 1000), 1, Money()});
+    for (auto _ : state) benchmark::DoNotOptimize(e.execute(orders, pool));
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(orders.size()));
+}
+BENCHMARK(BM_EngineExecute)->Arg(1)->Arg(4)->UseRealTime();
+
+// VaR / ES for a 500-holding portfolio; Args are paths and threads.
+static void BM_RiskEngine(benchmark::State& state) {
+    Market m;
+    fillMarket(m, 500);
+    User u("bench");
+    fillUser(u, m, 500);
+    ThreadPool pool(static_cast<size_t>(state.range(1)));
+    RiskEngine::Options opt;
+    opt.paths = static_cast<size_t>(state.range(0));
+    for (auto _ : state) benchmark::DoNotOptimize(RiskEngine(m, pool).run(u.portfolio(), {0.95, 0.99}, opt));
+    state.counters["paths/s"] = benchmark::Counter(static_cast<double>(state.iterations()) * state.range(0),
+                                                   benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_RiskEngine)->Args({100000, 1})->Args({1000000, 4})->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// Heap allocations and live heap bytes for a million holdings, through
+// the pooled Portfolio and through a plain unordered_map of the same type.
+static void BM_MillionHoldings(benchmark::State& state) {
+    const size_t n = 1000000;
+    double allocs = 0, mb = 0;
+    for (auto _ : state) {
+        size_t a0 = g_allocs.load(), b0 = g_liveBytes.load();
+        Portfolio p;
+        for (SecId id = 0; id < n; ++id) p.add(id, 1, Money::fromUnits(100));
+        allocs = static_cast<double>(g_allocs.load() - a0);
+        mb = static_cast<double>(g_liveBytes.load() - b0) / 1048576.0;
+        p.clear();
+    }
+    state.counters["allocs"] = allocs;
+    state.counters["heapMB"] = mb;
+}
+BENCHMARK(BM_MillionHoldings)->Unit(benchmark::kMillisecond);
+
+static void BM_MillionHoldingsStdMap(benchmark::State& state) {
+    const size_t n = 1000000;
+    double allocs = 0, mb = 0;
+    for (auto _ : state) {
+        size_t a0 = g_allocs.load(), b0 = g_liveBytes.load();
+        unordered_map<SecId, Holding> m;
+        for (SecId id = 0; id < n; ++id) m.emplace(id, Holding{id, 1, Money::fromUnits(100), Money::fromUnits(100)});
+        allocs = static_cast<double>(g_allocs.load() - a0);
+        mb = static_cast<double>(g_liveBytes.load() - b0) / 1048576.0;
+    }
+    state.counters["allocs"] = allocs;
+    state.counters["heapMB"] = mb;
+}
+BENCHMARK(BM_MillionHoldingsStdMap)->Unit(benchmark::kMillisecond);
+
+// Building a million-symbol universe: arena-backed addStock against one
+// Security object per addSecurity.
+static void BM_MillionSecurities(benchmark::State& state) {
+    const bool objects = state.range(0) != 0;
+    double allocs = 0, mb = 0;
+    for (auto _ : state) {
+        size_t a0 = g_allocs.load(), b0 = g_liveBytes.load();
+        Market m;
+        m.reserve(1000000);
+        char sym[32], name[48];
+        for (size_t i = 0; i < 1000000; ++i) {
+            string_view s(sym, static_cast<size_t>(snprintf(sym, sizeof sym, "SYM%zu", i)));
+            string_view nm(name, static_cast<size_t>(snprintf(name, sizeof name, "Listed Security Number %zu", i)));
+            if (objects) m.addSecurity(make_unique<Stock>(string(s), string(nm), 10.0, 0.01));
+            else m.addStock(s, nm, 10.0, 0.01);
+        }
+        allocs = static_cast<double>(g_allocs.load() - a0);
+        mb = static_cast<double>(g_liveBytes.load() - b0) / 1048576.0;
+    }
+    state.counters["allocs"] = allocs;
+    state.counters["heapMB"] = mb;
+    state.SetLabel(objects ? "addSecurity" : "addStock");
+}
+BENCHMARK(BM_MillionSecurities)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// Cached valuation (portfolio bound to the market) vs a full rescan
+// (valued against a different market object with the same prices).
+static void BM_PortfolioMarketValue(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0));
+    Market m;
+    fillMarket(m, n);
+    User u("bench");
+    fillUser(u, m, n);
+    for (auto _ : state) benchmark::DoNotOptimize(u.portfolio().marketValue(m));
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_PortfolioMarketValue)->Arg(10)->Arg(1000)->Arg(100000);
+
+static void BM_PortfolioMarketValueScan(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0));
+    Market m, other;
+    fillMarket(m, n);
+    fillMarket(other, n);
+    User u("bench");
+    fillUser(u, m, n);
+    for (auto _ : state) benchmark::DoNotOptimize(u.portfolio().marketValue(other));
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * state.range(0)));
+}
+BENCHMARK(BM_PortfolioMarketValueScan)->Arg(10)->Arg(1000)->Arg(100000);
+
+static void BM_PortfolioUnrealizedPnL(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0));
+    Market m, other;
+    fillMarket(m, n);
+    fillMarket(other, n);
+    User u("bench");
+    fillUser(u, m, n);
+    const Market& target = state.range(1) ? m : other;
+    for (auto _ : state) benchmark::DoNotOptimize(u.portfolio().unrealizedPnL(target));
+    state.SetLabel(state.range(1) ? "cached" : "scan");
+}
+BENCHMARK(BM_PortfolioUnrealizedPnL)->ArgsProduct({{10, 1000, 100000}, {0, 1}});
+
+// Per-tick cost of keeping a bound portfolio's valuation current.
+static void BM_TickWithPortfolio(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0));
+    Market m;
+    fillMarket(m, 100000);
+    User u("bench");
+    fillUser(u, m, n);
+    ThreadPool pool(1);
+    for (auto _ : state) m.tick(pool, 42);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_TickWithPortfolio)->Arg(0)->Arg(1000)->Arg(100000);
+
+// Alternating buy/sell round trips on one account.
+static void BM_UserBuySell(benchmark::State& state) {
+    Market m;
+    fillMarket(m, 1000);
+    User u("bench");
+    u.addFunds(Money::fromDouble(1e14));
+    mt19937 rng(42);
+    for (auto _ : state) {
+        SecId id = static_cast<SecId>(rng() % 1000);
+        u.buy(m, id, 10);
+        u.sell(m, id, 10);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * 2);
+}
+BENCHMARK(BM_UserBuySell);
+
+// Same, through the string-symbol API used at the I/O boundary.
+static void BM_UserBuySellBySymbol(benchmark::State& state) {
+    Market m;
+    fillMarket(m, 1000);
+    User u("bench");
+    u.addFunds(Money::fromDouble(1e14));
+    vector<string> syms;
+    for (SecId id = 0; id < 1000; ++id) syms.emplace_back(m.symbol(id));
+    mt19937 rng(42);
+    for (auto _ : state) {
+        const string& s = syms[rng() % 1000];
+        u.buy(m, s, 10);
+        u.sell(m, s, 10);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * 2);
+}
+BENCHMARK(BM_UserBuySellBySymbol);
+
+static void BM_UserBuyJournaled(benchmark::State& state) {
+    Market m;
+    fillMarket(m, 1000);
+    string wal = benchPath("imp_bench.wal"), snap = benchPath("imp_bench.snap");
+    {
+        Journal j(wal);
+        User u("bench");
+        u.attachJournal(&j, snap);
+        u.addFunds(Money::fromDouble(1e14));
+        mt19937 rng(42);
+        for (auto _ : state) u.buy(m, static_cast<SecId>(rng() % 1000), 1);
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+    }
+    filesystem::remove(wal);
+    filesystem::remove(snap);
+}
+BENCHMARK(BM_UserBuyJournaled);
+
+// Synthetic order flow on one book: passive limits within 20 ticks of the
+// mid, cancels of random resting orders and marketable orders crossing a
+// few levels, in roughly 9:9:2 proportion. Reported time is per operation.
+static void BM_OrderBookFlow(benchmark::State& state) {
+    struct Op { uint8_t kind; OrderBook::Side side; Money price; long long qty; };
+    mt19937 rng(42);
+    vector<Op> ops(1 << 16);
+    for (auto& op : ops) {
+        unsigned r = rng() % 20;
+        op.kind = r < 9 ? 0 : r < 18 ? 1 : 2;
+        op.side = rng() & 1 ? OrderBook::Side::Buy : OrderBook::Side::Sell;
+        int off = static_cast<int>(rng() % 20) + 1;
+        if (op.kind == 2) off = -static_cast<int>(rng() % 3);
+        int ticks = op.side == OrderBook::Side::Buy ? -off : off;
+        op.price = Money::fromUnits(1000000 + ticks * 100);
+        op.qty = 1 + rng() % 100;
+    }
+    OrderBook book(1 << 14);
+    vector<OrderBook::OrderId> live;
+    live.reserve(1 << 16);
+    long long filled = 0;
+    auto onFill = [&](const OrderBook::Fill& f) { filled += f.quantity; };
+    size_t i = 0;
+    for (auto _ : state) {
+        const Op& op = ops[i++ & (ops.size() - 1)];
+        if (op.kind == 1 && !live.empty()) {
+            size_t k = rng() % live.size();
+            book.cancel(live[k]);
+            live[k] = live.back();
+            live.pop_back();
+        } else if (op.kind == 2) {
+            book.add(1, op.side, op.price, op.qty * 4, onFill, false);
+        } else if (OrderBook::OrderId id = book.add(0, op.side, op.price, op.qty, onFill)) {
+            live.push_back(id);
+        }
+    }
+    benchmark::DoNotOptimize(filled);
+    state.counters["resting"] = static_cast<double>(book.size());
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_OrderBookFlow);
+
+// A resting sell crossed by a buy between two accounts, settled into both.
+static void BM_ExchangeCross(benchmark::State& state) {
+    Market m;
+    fillMarket(m, 1000);
+    User buyer("buyer"), seller("seller");
+    buyer.addFunds(Money::fromDouble(1e14));
+    seller.addFunds(Money::fromDouble(1e14));
+    for (SecId id = 0; id < 1000; ++id) seller.buy(m, id, 1000000);
+    Exchange ex(m);
+    auto b = ex.join(buyer), s = ex.join(seller);
+    mt19937 rng(42);
+    for (auto _ : state) {
+        SecId id = static_cast<SecId>(rng() % 1000);
+        Money px = Money::fromDouble(m.price(id));
+        ex.place(s, id, OrderBook::Side::Sell, 10, px);
+        ex.place(b, id, OrderBook::Side::Buy, 10, px);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_ExchangeCross);
+
+// A resting bid holding most of the buyer's cash; each round the buyer also
+// tries to spend that cash through User::buy (refused by the reservation),
+// then a sell crosses the bid and must settle.
+static void BM_ExchangeCrossAfterWithdrawal(benchmark::State& state) {
+    Market m;
+    fillMarket(m, 1);
+    User buyer("buyer"), seller("seller");
+    buyer.addFunds(Money::fromDouble(1e6));
+    seller.addFunds(Money::fromDouble(1e6));
+    Exchange ex(m);
+    auto b = ex.join(buyer), s = ex.join(seller);
+    Money px = Money::fromDouble(m.price(0));
+    long long lot = buyer.available().units() / px.units() - 1;
+    seller.buy(m, 0, lot);
+    int64_t refused = 0;
+    for (auto _ : state) {
+        if (!ex.place(b, 0, OrderBook::Side::Buy, lot, px)) { state.SkipWithError("bid did not rest"); break; }
+        try {
+            buyer.buy(m, 0, lot);
+        } catch (const exception&) {
+            ++refused;
+        }
+        ex.place(s, 0, OrderBook::Side::Sell, lot, px);
+        if (ex.fills().size() != 1) { state.SkipWithError("cross did not settle"); break; }
+        buyer.sell(m, 0, lot);  // both sides back to where they started
+        seller.buy(m, 0, lot);
+    }
+    if (refused != state.iterations()) state.SkipWithError("reserved cash was spent");
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_ExchangeCrossAfterWithdrawal);
+
+// One tick of a 10k-security market with range(0) resting limit/stop orders
+// placed 0.5-10% away from the price on the side that does not fire yet;
+// whatever fires is checked against the tick that fired it and re-placed, so
+// the book stays full. Compare against BM_MarketTick for the trigger overhead.
+static void BM_TriggerBookTick(benchmark::State& state) {
+    const size_t secs = 10000;
+    Market m;
+    fillMarket(m, secs);
+    TriggerBook book(m);
+    mt19937 rng(42);
+    auto order = [&](SecId id) {
+        bool stop = rng() & 1, buy = rng() & 1;
+        double away = 0.005 + 0.095 * (rng() % 1000) / 1000.0;
+        double px = m.price(id) * (buy != stop ? 1 - away : 1 + away);
+        TriggerBook::Order o{static_cast<uint32_t>(rng() % 100000), id,
+                             buy ? TriggerBook::Side::Buy : TriggerBook::Side::Sell,
+                             stop ? TriggerBook::Type::Stop : TriggerBook::Type::Limit, 1, Money(), Money()};
+        (stop ? o.stop : o.limit) = Money::fromDouble(px);
+        return o;
+    };
+    for (size_t i = 0; i < static_cast<size_t>(state.range(0)); ++i) book.place(order(static_cast<SecId>(i % secs)));
+    size_t fired = 0;
+    for (auto _ : state) {
+        m.tick(rng);
+        auto f = book.take();
+        fired += f.size();
+        state.PauseTiming();
+        for (auto& x : f) {
+            // Taken right after the tick, so every order fired at today's
+            // price and a limit can fill there.
+            if (x.price != Money::fromDouble(m.price(x.order.security)) || !TriggerBook::within(x.order, x.price))
+                state.SkipWithError("order fired away from its tick");
+            book.place(order(x.order.security));
+        }
+        state.ResumeTiming();
+    }
+    state.counters["fired/tick"] = static_cast<double>(fired) / static_cast<double>(state.iterations());
+}
+BENCHMARK(BM_TriggerBookTick)->Arg(0)->Arg(100000)->Arg(2000000)->Unit(benchmark::kMicrosecond);
+
+// Place then cancel on a book already holding range(0) orders.
+static void BM_TriggerBookPlaceCancel(benchmark::State& state) {
+    Market m;
+    fillMarket(m, 1000);
+    TriggerBook book(m);
+    mt19937 rng(42);
+    auto order = [&]() {
+        SecId id = static_cast<SecId>(rng() % 1000);
+        return TriggerBook::Order{0, id, TriggerBook::Side::Buy, TriggerBook::Type::Limit, 1, Money(),
+                                  Money::fromDouble(m.price(id) * 0.5 * (1 + (rng() % 100) / 100.0))};
+    };
+    for (size_t i = 0; i < static_cast<size_t>(state.range(0)); ++i) book.place(order());
+    for (auto _ : state) book.cancel(book.place(order()));
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_TriggerBookPlaceCancel)->Arg(1000)->Arg(1000000);
+
+static void BM_UserSaveLoadText(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0));
+    Market m;
+    fillMarket(m, n);
+    User u("bench");
+    fillUser(u, m, n);
+    string path = benchPath("imp_bench.sav");
+    for (auto _ : state) {
+        u.save(path, m);
+        User v("load");
+        v.load(path, m);
+        benchmark::DoNotOptimize(v.balance());
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * state.range(0)));
+    filesystem::remove(path);
+}
+BENCHMARK(BM_UserSaveLoadText)->Arg(1000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_UserSnapshotRoundTrip(benchmark::State& state) {
+    const size_t n = static_cast<size_t>(state.range(0));
+    Market m;
+    fillMarket(m, n);
+    User u("bench");
+    fillUser(u, m, n);
+    string path = benchPath("imp_bench.snap");
+    for (auto _ : state) {
+        u.saveSnapshot(path, m);
+        User v("load");
+        v.loadSnapshot(path, m);
+        benchmark::DoNotOptimize(v.balance());
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * state.range(0)));
+    filesystem::remove(path);
+}
+BENCHMARK(BM_UserSnapshotRoundTrip)->Arg(1000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_SplitCSV(benchmark::State& state) {
+    const string line = "NVDA, 1250 ,\"950.12345678\"";
+    for (auto _ : state) benchmark::DoNotOptimize(util::splitCSV(line));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * line.size()));
+}
+BENCHMARK(BM_SplitCSV);
+
+// Holdings-style CSV: symbol, quantity, cost, plus a quoted note that
+// sometimes carries "" escapes and embedded commas.
+static string csvText(size_t rows) {
+    mt19937 rng(3);
+    string s;
+    s.reserve(rows * 48);
+    char buf[96];
+    for (size_t i = 0; i < rows; ++i) {
+        int n = snprintf(buf, sizeof buf, "SYM%zu,%u,%.8f,", i % 5000, unsigned(rng() % 100000),
+                         100.0 + (rng() % 100000) / 97.0);
+        s.append(buf, static_cast<size_t>(n));
+        s += (i % 4 == 0) ? "\"said \"\"hold\"\", long\"\n" : "\"plain note\"\n";
+    }
+    return s;
+}
+
+// The splitter util::splitCSV used before CsvReader, one getline per record.
+static vector<string> charSplit(const string& line) {
+    vector<string> out;
+    string cur; bool inQuote = false;
+    for (char c : line) {
+        if (c == '"') { inQuote = !inQuote; }
+        else if (c == ',' && !inQuote) { out.push_back(util::trim(cur)); cur.clear(); }
+        else cur.push_back(c);
+    }
+    out.push_back(util::trim(cur));
+    return out;
+}
+
+static void BM_CsvCharSplit(benchmark::State& state) {
+    const string text = csvText(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        istringstream in(text);
+        string line;
+        size_t fields = 0;
+        while (getline(in, line)) fields += charSplit(line).size();
+        benchmark::DoNotOptimize(fields);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * text.size()));
+}
+BENCHMARK(BM_CsvCharSplit)->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+
+static void BM_CsvReader(benchmark::State& state) {
+    const string text = csvText(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        util::CsvReader csv(text);
+        size_t fields = 0;
+        while (csv.next()) fields += csv.size();
+        benchmark::DoNotOptimize(fields);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * text.size()));
+}
+BENCHMARK(BM_CsvReader)->Arg(1 << 20)->Unit(benchmark::kMillisecond);
+
+// The stringstream formatter util::toMoney used before formatMoney.
+static string streamMoney(double v) {
+    stringstream ss;
+    ss.setf(std::ios::fixed); ss << setprecision(2) << v;
+    return ss.str();
+}
+
+static void BM_ToMoneyStream(benchmark::State& state) {
+    double v = 1234.5678;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(streamMoney(v));
+        v += 0.01;
+    }
+}
+BENCHMARK(BM_ToMoneyStream);
+
+static void BM_ToMoney(benchmark::State& state) {
+    double v = 1234.5678;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(util::toMoney(v));
+        v += 0.01;
+    }
+}
+BENCHMARK(BM_ToMoney);
+
+static void BM_FormatMoney(benchmark::State& state) {
+    char buf[util::kMoneyChars];
+    double v = 1234.5678;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(util::formatMoney(buf, buf + sizeof buf, v));
+        benchmark::ClobberMemory();
+        v += 0.01;
+    }
+}
+BENCHMARK(BM_FormatMoney);
+
+BENCHMARK_MAIN();